@@ -106,6 +106,123 @@ lldt(register const uint16_t selector /*!< A selector into the GDT for the LDT.
  __asm volatile("lldt %%ax" : : "a" (selector) : );
 }
 
+/*! Wrapper for the lidt instruction. */
+static inline void
+lidt(register const uint16_t limit       /*!< The limit of the IDT. This is
+                                              the size of the IDT minus one
+                                              byte. */,
+     register const uint32_t IDTAddress /*!< The starting address of the IDT.
+                                         */)
+{
+ __asm volatile("sub $8,%%esp\n mov %%eax,4(%%esp)\n \
+                 mov %%bx,2(%%esp)\n lidt 2(%%esp)\n add $8,%%esp" :
+                : "a" (IDTAddress), "b" (limit) : );
+}
+
+/*! Wrapper for the ltr instruction. */
+static inline void
+ltr(register const uint16_t selector /*!< A selector into the GDT for the TSS.
+                                      */)
+{
+ __asm volatile("ltr %%ax" : : "a" (selector) : );
+}
+
+/*! Wrapper for reading the cr2 register.
+    \returns The address that caused the last page fault. */
+static inline uint32_t
+read_cr2(void)
+{
+ uint32_t value;
+ __asm volatile("mov %%cr2,%0" : "=r" (value));
+ return value;
+}
+
+/*! Wrapper for reading the cr0 register.
+    \returns The value of cr0. */
+static inline uint32_t
+read_cr0(void)
+{
+ uint32_t value;
+ __asm volatile("mov %%cr0,%0" : "=r" (value));
+ return value;
+}
+
+/*! Wrapper for writing the cr0 register. */
+static inline void
+write_cr0(register const uint32_t value /*!< The value to write. */)
+{
+ __asm volatile("mov %0,%%cr0" : : "r" (value) : "memory");
+}
+
+/*! Wrapper for reading the cr3 register.
+    \returns The physical address of the current page directory. */
+static inline uint32_t
+read_cr3(void)
+{
+ uint32_t value;
+ __asm volatile("mov %%cr3,%0" : "=r" (value));
+ return value;
+}
+
+/*! Wrapper for writing the cr3 register. Flushes all non-global entries
+    from the TLB. */
+static inline void
+write_cr3(register const uint32_t value /*!< The physical address of the
+                                             page directory to use. */)
+{
+ __asm volatile("mov %0,%%cr3" : : "r" (value) : "memory");
+}
+
+/*! Wrapper for reading the cr4 register.
+    \returns The value of cr4. */
+static inline uint32_t
+read_cr4(void)
+{
+ uint32_t value;
+ __asm volatile("mov %%cr4,%0" : "=r" (value));
+ return value;
+}
+
+/*! Wrapper for writing the cr4 register. */
+static inline void
+write_cr4(register const uint32_t value /*!< The value to write. */)
+{
+ __asm volatile("mov %0,%%cr4" : : "r" (value) : "memory");
+}
+
+/*! Wrapper for the clts instruction, which clears the task switched flag in
+    cr0 so FPU and SSE instructions no longer fault. */
+static inline void
+clts(void)
+{
+ __asm volatile("clts" : : : "memory");
+}
+
+/*! Wrapper for the fxsave instruction. */
+static inline void
+fxsave(register void* const area /*!< 512 bytes, aligned to 16, the FPU and
+                                      SSE state is stored in. */)
+{
+ __asm volatile("fxsave (%0)" : : "r" (area) : "memory");
+}
+
+/*! Wrapper for the fxrstor instruction. */
+static inline void
+fxrstor(register const void* const area /*!< 512 bytes, aligned to 16, in
+                                             the format written by
+                                             fxsave. */)
+{
+ __asm volatile("fxrstor (%0)" : : "r" (area) : "memory");
+}
+
+/*! Wrapper for the invlpg instruction. */
+static inline void
+invlpg(register const uint32_t address /*!< An address in the page whose
+                                            TLB entry is to be flushed. */)
+{
+ __asm volatile("invlpg (%0)" : : "r" (address) : "memory");
+}
+
 static inline uint64_t rdtsc(void)
 {
  uint32_t low_value, high_value;
@@ -122,6 +239,33 @@ sti(void)
  __asm volatile("sti" : : : );
 }
 
+/*! Wrapper for the monitor instruction. Makes a following mwait return
+    when the cache line holding address is written. */
+static inline void
+monitor(register const volatile void* const address /*!< The address to
+                                                         watch. */)
+{
+ __asm volatile("monitor" : : "a" (address), "c" (0), "d" (0) : "memory");
+}
+
+/*! Enables interrupts and waits in mwait for an interrupt or a write to
+    the line armed by monitor. mwait runs in the shadow of sti, so an
+    interrupt can not arrive between the two and be missed. */
+static inline void
+sti_mwait(void)
+{
+ __asm volatile("sti; mwait" : : "a" (0), "c" (0) : "memory");
+}
+
+/*! Wrapper for the pause instruction, which tells the processor it is
+    spinning on a lock. It is encoded as rep nop, which older processors
+    treat as nop. */
+static inline void
+pause(void)
+{
+ __asm volatile("rep; nop" : : : "memory");
+}
+
 /*! Wrapper for a 8-bit out instruction. */
 static inline void
 outb(register const int16_t portNumber  /*!< The number of the port to write
@@ -13,6 +13,8 @@
 #ifndef _SYSDEFINES_H_
 #define _SYSDEFINES_H_
 
+#include <stdint.h>
+
 /* Constant declarations. */
 
 /*! Return code when system call returns normally. */
@@ -21,11 +23,20 @@
 #define ERROR                   (-1)
 /*! Return code when system call is unknown. */
 #define ERROR_ILLEGAL_SYSCALL   (-2)
+/*! Return code when a system call did not block as the condition it was
+    to wait for no longer holds. */
+#define ERROR_WOULD_BLOCK       (-3)
 
 /*! System call that returns the version of the kernel. */
 #define SYSCALL_VERSION         (0)
-/*! System call that prints a string. */
+/*! System call that prints a string. The address of the string is passed
+    in edi. At most MAX_PRINT_LENGTH characters are printed. The system call
+    returns ALL_OK, or ERROR if the string runs into memory the caller can
+    not read. */
 #define SYSCALL_PRINTS          (1)
+
+/*! Longest string SYSCALL_PRINTS prints. Longer strings are cut off. */
+#define MAX_PRINT_LENGTH        (4096)
 /*! System call that prints a hexadecimal value. */
 #define SYSCALL_PRINTHEX        (2)
 
@@ -41,13 +52,18 @@
 #define SYSCALL_FREE            (5)
 
 /*! System call that terminates the currently running
- *  thread. It takes no parameters. Terminates the process
- *  when there are no threads left. */
+ *  thread. The exit status is passed in edi. Terminates the process
+ *  when there are no threads left, and the exit status of the last
+ *  thread becomes that of the process. The stack allocated for
+ *  the thread by SYSCALL_CREATE_THREAD is freed. */
 #define SYSCALL_TERMINATE       (6)
 
 /*! System call that creates a new process with one single
  *  thread. The program used is the executable whose index is
- *  passed in edi. */
+ *  passed in edi. The new process and then the caller are put
+ *  last in the ready queue. The new process is a child of the
+ *  caller. The system call returns the id of the process, which
+ *  is also the id of its thread, or ERROR. */
 #define SYSCALL_CREATEPROCESS   (7)
 
 /*! System call that will temporarily move the calling thread from the running
@@ -55,4 +71,267 @@
     ALL_OK.*/
 #define SYSCALL_YIELD           (8)
 
+/*! System call that creates a copy of the calling process. The copy starts
+    with the same registers, memory and heap as the caller. The copy and
+    then the caller are put last in the ready queue. The system call
+    returns 0 in the copy, the id of the copy in the caller or ERROR if the
+    copy could not be created. The copy is a child of the caller. Memory is
+    shared between the processes until either writes to it. */
+#define SYSCALL_FORK            (9)
+
+/*! System call that carries out a batch of SYSCALL_ALLOCATE and
+    SYSCALL_FREE requests in one kernel entry. The address of an array of
+    struct memory_request is passed in edi and the number of requests in
+    esi. The requests are carried out in order and the result of each is
+    stored in the request. The system call returns ALL_OK, or ERROR if the
+    array can not be written by the caller. */
+#define SYSCALL_MEMORY_BATCH    (10)
+
+/*! System call that copies statistics on memory allocation into a struct
+    memory_statistics whose address is passed in edi. The heap figures
+    describe the calling process, the counters and histograms cover all
+    processes since the kernel booted. The system call returns ALL_OK, or
+    ERROR if the structure can not be written by the caller. */
+#define SYSCALL_MEMORY_STATISTICS (11)
+
+/*! System call that allocates a memory block starting at a multiple of a
+    power of two. The length is passed in edi and the alignment in esi. The
+    system call returns the address or an error code. */
+#define SYSCALL_ALLOCATE_ALIGNED (12)
+
+/*! System call that allocates a memory block filled with zeroes. The
+    length is passed in edi. The system call returns the address or an
+    error code. */
+#define SYSCALL_ALLOCATE_ZEROED (13)
+
+/*! System call that changes the length of a memory block allocated through
+    one of the allocate system calls. The address is passed in edi and the
+    new length in esi. The block is grown in place when the memory after it
+    is free, otherwise its contents are moved to a new block. The system
+    call returns the address of the block, or an error code if the block
+    is left unchanged. */
+#define SYSCALL_RESIZE          (14)
+
+/*! System call that sets the base priority of the calling thread. The
+    priority is passed in edi, 0 is the highest and PRIORITY_LEVELS - 1 the
+    lowest. The thread runs at its base priority until it uses up its time
+    slices, and is moved back to it now and then. The system call returns
+    ALL_OK, or ERROR if the priority is out of range. */
+#define SYSCALL_SET_PRIORITY    (15)
+
+/*! Number of priority levels of the scheduler. */
+#define PRIORITY_LEVELS         (4)
+
+/*! System call that creates a thread in the calling process. The address
+    the thread starts at is passed in edi and the size of its stack in esi,
+    or 0 for DEFAULT_THREAD_STACK_SIZE. Sizes outside [MIN_THREAD_STACK_SIZE,
+    MAX_THREAD_STACK_SIZE] are refused. The stack is allocated from the heap
+    of the process. The thread starts with all other registers zero and
+    must end with SYSCALL_TERMINATE rather than return. The system call
+    returns the id of the new thread, see SYSCALL_THREAD_ID, or an error
+    code. */
+#define SYSCALL_CREATE_THREAD   (16)
+
+/*! Size of the stack of a thread created with a stack size of 0. */
+#define DEFAULT_THREAD_STACK_SIZE (64 * 1024)
+
+/*! Smallest stack SYSCALL_CREATE_THREAD allocates. */
+#define MIN_THREAD_STACK_SIZE   (4 * 1024)
+
+/*! Largest stack SYSCALL_CREATE_THREAD allocates. */
+#define MAX_THREAD_STACK_SIZE   (16 * 1024 * 1024)
+
+/*! System call that blocks the calling thread on a word of memory. The
+    address of the word is passed in edi and the value it is expected to
+    hold in esi. If the word holds another value the system call returns
+    ERROR_WOULD_BLOCK at once. Otherwise the thread sleeps until another
+    thread of the process calls SYSCALL_WAKE on the same address, and
+    ALL_OK is returned. The address must be aligned to 4 bytes and
+    writable, or ERROR is returned. Callers must check the word again, as a
+    wake may be meant for another waiter. */
+#define SYSCALL_WAIT            (17)
+
+/*! System call that wakes threads blocked in SYSCALL_WAIT. The address is
+    passed in edi and the largest number of threads to wake in esi. The
+    threads that waited the longest are woken first. The system call
+    returns the number of threads woken. */
+#define SYSCALL_WAKE            (18)
+
+/*! System call that sends a message to a thread and waits for its reply.
+    The id of the receiving thread is passed in edi and the message, two
+    words, in esi and ebx. The system call returns ALL_OK with the reply in
+    esi and ebx once the receiver has replied, or ERROR if there is no such
+    thread or it terminates before it replies. If the receiver is waiting
+    in SYSCALL_RECEIVE it runs at once in place of the sender. */
+#define SYSCALL_SEND            (19)
+
+/*! System call that waits for a message sent with SYSCALL_SEND. The system
+    call returns the id of the sender, with the message in esi and ebx. If
+    the id of a thread is passed in edi, the thread is first given a reply
+    as with SYSCALL_REPLY, which lets a server answer a request and wait
+    for the next one in one system call. ERROR is returned if that thread
+    does not wait for a reply. */
+#define SYSCALL_RECEIVE         (20)
+
+/*! System call that answers a message received with SYSCALL_RECEIVE. The
+    id of the sender is passed in edi and the reply in esi and ebx. The
+    system call returns ALL_OK, or ERROR if the thread does not wait for a
+    reply from the caller. */
+#define SYSCALL_REPLY           (21)
+
+/*! System call that returns the id of the calling thread. Ids are
+    positive and are not reused while the thread exists. */
+#define SYSCALL_THREAD_ID       (22)
+
+/*! Number of words in a message of SYSCALL_SEND. */
+#define MESSAGE_WORDS           (2)
+
+/*! System call that maps memory into the calling process and another
+    process. A thread of the other process is passed in edi and the number
+    of bytes in esi. The memory is zeroed, page aligned and mapped at the
+    same address in both processes, and stays mapped until they terminate.
+    Processes forked from either share it too. SYSCALL_WAIT and
+    SYSCALL_WAKE on a word in it work across the processes. The system call
+    returns the address, or ERROR. */
+#define SYSCALL_SHARE_MEMORY    (23)
+
+/*! System call that waits for a child of the calling process to
+    terminate. The id of the child is passed in edi, or 0 for any child.
+    The system call returns the id of the child with its exit status in
+    esi, or ERROR if the caller has no such child. Each child can be waited
+    for once. A child that terminates before the caller waits keeps its
+    exit status until then. */
+#define SYSCALL_WAIT_CHILD      (24)
+
+/*! Exit status of a process the kernel terminated, for example on a page
+    fault. */
+#define EXIT_STATUS_KILLED      (INT32_MIN)
+
+/*! System call that sets up rings through which the calling process
+    queues operations for the kernel, see struct async_rings. The number
+    of submission entries is passed in edi and is rounded up to a power of
+    two. The completion ring gets twice as many entries. The rings are
+    mapped as with SYSCALL_SHARE_MEMORY, but into the calling process only.
+    The system call returns their address, or ERROR if the process has
+    rings already, the number is 0 or above ASYNC_MAX_ENTRIES, or memory is
+    exhausted. A process forked from the caller sees the memory but has no
+    rings of its own, and must not use them. */
+#define SYSCALL_ASYNC_SETUP     (25)
+
+/*! System call that carries out the operations queued in the submission
+    ring of the calling process, in order, until the ring is empty or the
+    completion ring is full. Cpus with nothing to run do the same without
+    any system call, so a process that keeps another cpu idle need not
+    enter the kernel at all. The system call returns the number of
+    operations taken from the ring, or ERROR if the process has no
+    rings. */
+#define SYSCALL_ASYNC_ENTER     (26)
+
+/*! Largest number of submission entries of SYSCALL_ASYNC_SETUP. */
+#define ASYNC_MAX_ENTRIES       (4096)
+
+/*! Number of argument words of an asynchronous operation. */
+#define ASYNC_ARGUMENTS         (6)
+
+/*! Size of a cache line. The words written by the process and those
+    written by the kernel in struct async_rings are this far apart. */
+#define ASYNC_CACHE_LINE        (64)
+
+/*! Asynchronous operation that completes with ALL_OK once the number of
+    milliseconds in arguments[0] has passed. It is not a system call on its
+    own. The other operations are the system calls SYSCALL_PRINTS,
+    SYSCALL_ALLOCATE, SYSCALL_ALLOCATE_ALIGNED, SYSCALL_ALLOCATE_ZEROED,
+    SYSCALL_RESIZE, SYSCALL_FREE, SYSCALL_WAKE and SYSCALL_REPLY, with
+    their arguments in the order of edi, esi and ebx. Replies are given on
+    behalf of the thread that called SYSCALL_ASYNC_SETUP. */
+#define ASYNC_TIMEOUT           (0x100)
+
+/*! Number of size classes in struct memory_statistics. Class i holds free
+    blocks of size [2^i, 2^(i+1)). */
+#define MEMORY_SIZE_CLASSES     (32)
+
+/*! Number of buckets in the latency histograms of struct
+    memory_statistics. Bucket i counts calls that took [2^i, 2^(i+1))
+    cycles. */
+#define MEMORY_LATENCY_BUCKETS  (32)
+
+/* Type declarations. */
+
+/*! One request of a SYSCALL_MEMORY_BATCH system call. */
+struct memory_request
+{
+ int32_t  operation; /*!< SYSCALL_ALLOCATE or SYSCALL_FREE. */
+ uint32_t argument;  /*!< The length to allocate or the address to free. */
+ int32_t  result;    /*!< Set to what the system call given in operation
+                          would have returned. */
+};
+
+/*! One operation queued in the submission ring of struct async_rings. */
+struct async_submission
+{
+ int32_t  operation; /*!< A system call or ASYNC_TIMEOUT. */
+ uint32_t user_data; /*!< Handed back in the completion. */
+ uint32_t arguments[ASYNC_ARGUMENTS]; /*!< Arguments of the operation. */
+};
+
+/*! The result of an operation, queued in the completion ring of struct
+    async_rings. Completions may come in another order than the
+    submissions, as timeouts complete late. */
+struct async_completion
+{
+ uint32_t user_data; /*!< Taken from the submission. */
+ int32_t  result;    /*!< What the system call in operation would have
+                          returned, or ERROR_ILLEGAL_SYSCALL if it can not
+                          be queued. */
+};
+
+/*! Header of the rings set up by SYSCALL_ASYNC_SETUP. The submission and
+    completion entries follow it at the offsets given. Indices count
+    entries since the rings were set up, and an entry lives at its index
+    modulo the number of entries. The process queues a submission by
+    filling in the entry at submission_tail and then incrementing it, and
+    takes a completion by reading the entry at completion_head and then
+    incrementing it. The kernel only writes the indices in its own line.
+    Waiting with SYSCALL_WAIT on completion_tail sleeps until the kernel
+    queues completions. */
+struct async_rings
+{
+ volatile uint32_t submission_tail; /*!< Written by the process. */
+ volatile uint32_t completion_head; /*!< Written by the process. */
+ uint8_t           process_line[ASYNC_CACHE_LINE - 2 * sizeof(uint32_t)];
+ volatile uint32_t submission_head; /*!< Written by the kernel. */
+ volatile uint32_t completion_tail; /*!< Written by the kernel. */
+ uint8_t           kernel_line[ASYNC_CACHE_LINE - 2 * sizeof(uint32_t)];
+ uint32_t          submission_entries; /*!< Number of submission entries. A
+                                            power of two. */
+ uint32_t          completion_entries; /*!< Number of completion entries.
+                                            Twice submission_entries. */
+ uint32_t          submissions; /*!< Offset of the first struct
+                                     async_submission from the header. */
+ uint32_t          completions; /*!< Offset of the first struct
+                                     async_completion from the header. */
+ uint8_t           constant_line[ASYNC_CACHE_LINE - 4 * sizeof(uint32_t)];
+};
+
+/*! Statistics returned by SYSCALL_MEMORY_STATISTICS. */
+struct memory_statistics
+{
+ uint32_t used_bytes;          /*!< Bytes in allocated blocks. */
+ uint32_t free_bytes;          /*!< Bytes in free blocks. */
+ uint32_t free_bytes_per_class[MEMORY_SIZE_CLASSES]; /*!< Bytes in free
+                                    blocks per size class. */
+ uint32_t largest_free_block;  /*!< Size of the largest free block. */
+ uint32_t fragmentation;       /*!< External fragmentation in per mille, the
+                                    share of free bytes outside the largest
+                                    free block. */
+ uint32_t allocations;         /*!< Successful allocations. */
+ uint32_t allocation_failures; /*!< Allocations that returned ERROR. */
+ uint32_t frees;               /*!< Successful frees. */
+ uint32_t free_failures;       /*!< Frees that returned ERROR. */
+ uint32_t allocation_cycles[MEMORY_LATENCY_BUCKETS]; /*!< Histogram of the
+                                    time taken by allocations. */
+ uint32_t free_cycles[MEMORY_LATENCY_BUCKETS]; /*!< Histogram of the time
+                                    taken by frees. */
+};
+
 #endif
@@ -0,0 +1,453 @@
+/* Copyright (c) 1997-2016, FenixOS Developers
+   All Rights Reserved.
+
+   This file is subject to the terms and conditions defined in
+   file 'LICENSE', which is part of this source code package.
+ */
+
+/*! \file main.c This file holds a benchmark that runs the heaps in
+   src/kernel/mm.c as a normal program on the build machine. A large
+   anonymous mapping stands in for the heap range of a process. Linux only
+   backs the pages that are touched, as the kernel does.
+
+   Each trace is replayed against struct heap, which serves the kernel,
+   and struct extent_heap, which serves the system calls of user programs.
+   The extent heap keeps its bookkeeping in kernel memory, so a smaller
+   mapping at a low address stands in for the physical memory the frames
+   are taken from.
+
+   Each trace is a list of allocations and frees into a set of slots. It is
+   replayed twice: once timed, and once with the bookkeeping needed to find
+   the peak footprint and the fragmentation. */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "mm.h"
+
+/* The memory manager expects the kernel to define these. They bound the
+   memory frames are taken from. */
+uintptr_t lowest_available_physical_memory;
+uintptr_t top_of_available_physical_memory;
+
+/*! Size of the memory the heap is built over. */
+#define REGION_SIZE        ((size_t) 1 << 30)
+
+/*! Address and size of the memory standing in for physical memory. The
+    frame bitmap covers every frame below its end, so it is kept low. */
+#define PHYSICAL_ADDRESS   ((uintptr_t) 0x10000000)
+#define PHYSICAL_SIZE      ((size_t) 64 << 20)
+
+/*! Number of operations in each trace. */
+#define TRACE_LENGTH       (1000000)
+
+/*! Defines one step of a trace. */
+struct operation
+{
+ uint32_t slot; /*!< The slot the block is kept in. */
+ uint32_t size; /*!< Number of bytes to allocate, or 0 to free the block
+                     in the slot. */
+};
+
+/*! Defines a trace. */
+struct trace
+{
+ const char*       name;       /*!< Printed with the results. */
+ struct operation* operations; /*!< The steps of the trace. */
+ size_t            length;     /*!< Number of steps. */
+ uint32_t          slots;      /*!< Number of slots used by the trace. */
+};
+
+/*! Defines an allocator the traces are replayed against. */
+struct allocator
+{
+ const char* name;                  /*!< Printed with the results. */
+ void        (*reset)(void);        /*!< Makes the allocator empty. */
+ void*       (*allocate)(size_t);   /*!< Allocates a block. */
+ void        (*free)(void*);        /*!< Frees a block. */
+};
+
+/*! The memory the heaps are built over. */
+static uint8_t* region;
+
+/*! The heap measured as struct heap. */
+static struct heap heap;
+
+/*! The heap measured as struct extent_heap. */
+static struct extent_heap extent_heap;
+
+/*! State of the generator used by the synthetic traces. */
+static uint32_t random_state = 2463534242U;
+
+/* Helper functions. */
+
+/*! Returns the next number of a xorshift generator. */
+static uint32_t
+next_random(void)
+{
+ random_state ^= random_state << 13;
+ random_state ^= random_state >> 17;
+ random_state ^= random_state << 5;
+ return random_state;
+}
+
+/*! Returns a number in [low, high]. */
+static uint32_t
+random_between(const uint32_t low, const uint32_t high)
+{
+ return low + next_random() % (high - low + 1);
+}
+
+/*! Returns the time in nanoseconds. */
+static uint64_t
+now(void)
+{
+ struct timespec time;
+
+ clock_gettime(CLOCK_MONOTONIC, &time);
+ return (uint64_t) time.tv_sec * 1000000000U + time.tv_nsec;
+}
+
+/*! Starts a trace of at most TRACE_LENGTH steps. */
+static void
+trace_init(struct trace* const trace, const char* const name,
+           const uint32_t slots)
+{
+ trace->name = name;
+ trace->operations = malloc(TRACE_LENGTH * sizeof(struct operation));
+ trace->length = 0;
+ trace->slots = slots;
+
+ if (0 == trace->operations)
+ {
+  fprintf(stderr, "Out of memory\n");
+  exit(1);
+ }
+}
+
+/*! Appends a step to a trace. */
+static void
+trace_add(struct trace* const trace, const uint32_t slot, const uint32_t size)
+{
+ trace->operations[trace->length].slot = slot;
+ trace->operations[trace->length].size = size;
+ trace->length++;
+}
+
+/*! Builds the trace of src/program_0. The sizes come from the same
+    generator, computed with 32-bit arithmetic as on the target. The trace
+    has no failed allocations, as the heap range is far larger than what the
+    program keeps allocated. */
+static void
+program_0_trace(struct trace* const trace)
+{
+ uint32_t memory = 0;
+ uint32_t sizes[16];
+ int      used[16] = {0};
+ int32_t  total_memory_size = 0;
+ int      clock = 0;
+
+ trace_init(trace, "program_0", 16);
+
+ while (trace->length + 2 <= TRACE_LENGTH)
+ {
+  if ((0 == memory) || (1 == memory) || (UINT32_MAX == memory))
+   memory = 101;
+  memory = (9973 * ~memory) + (memory % 701);
+
+  sizes[clock] = ((uint32_t) (24 * 1024 * 1024 - total_memory_size) *
+                  (memory & (256 * 256 - 1))) / (256 * 256 * 8);
+
+  used[clock] = (sizes[clock] > 0) && (sizes[clock] < 24 * 1024 * 1024);
+  if (used[clock])
+  {
+   trace_add(trace, clock, sizes[clock]);
+   total_memory_size += sizes[clock];
+  }
+
+  clock = (clock + 1) & 15;
+
+  if (used[clock])
+  {
+   trace_add(trace, clock, 0);
+   total_memory_size -= sizes[clock];
+  }
+ }
+}
+
+/*! Builds a trace of bursts. Each burst allocates a number of blocks and
+    then frees them in random order. */
+static void
+bursty_trace(struct trace* const trace)
+{
+ uint32_t order[4096];
+
+ trace_init(trace, "bursty", 4096);
+
+ for (;;)
+ {
+  const uint32_t count = random_between(64, 4096);
+  uint32_t       i;
+
+  if (trace->length + 2 * count > TRACE_LENGTH)
+   break;
+
+  for (i = 0; i < count; i++)
+  {
+   trace_add(trace, i, random_between(16, 2048));
+   order[i] = i;
+  }
+
+  for (i = count; i > 0; i--)
+  {
+   const uint32_t j = next_random() % i;
+   const uint32_t slot = order[j];
+
+   order[j] = order[i - 1];
+   trace_add(trace, slot, 0);
+  }
+ }
+}
+
+/*! Builds a trace where a few long-lived blocks of up to 64 KiB are
+    replaced now and then while many short-lived blocks come and go between
+    them. */
+static void
+mixed_lifetime_trace(struct trace* const trace)
+{
+ enum { LONG_LIVED = 256, SHORT_LIVED = 32 };
+ int      used[LONG_LIVED + SHORT_LIVED] = {0};
+ uint32_t next_short = 0;
+
+ trace_init(trace, "mixed lifetimes", LONG_LIVED + SHORT_LIVED);
+
+ while (trace->length + 2 <= TRACE_LENGTH)
+ {
+  uint32_t slot;
+
+  if (0 == next_random() % 16)
+  {
+   slot = next_random() % LONG_LIVED;
+   if (used[slot])
+    trace_add(trace, slot, 0);
+   trace_add(trace, slot, random_between(1024, 64 * 1024));
+  }
+  else
+  {
+   /* Short-lived blocks are freed after SHORT_LIVED other short-lived
+      blocks have been allocated. */
+   slot = LONG_LIVED + next_short;
+   next_short = (next_short + 1) % SHORT_LIVED;
+   if (used[slot])
+    trace_add(trace, slot, 0);
+   trace_add(trace, slot, random_between(16, 512));
+  }
+
+  used[slot] = 1;
+ }
+}
+
+/*! Builds a trace of small objects allocated and freed at random. */
+static void
+small_object_trace(struct trace* const trace)
+{
+ int used[4096] = {0};
+
+ trace_init(trace, "small objects", 4096);
+
+ while (trace->length < TRACE_LENGTH)
+ {
+  const uint32_t slot = next_random() % 4096;
+
+  trace_add(trace, slot, used[slot] ? 0 : random_between(8, 128));
+  used[slot] = !used[slot];
+ }
+}
+
+/*! Makes the heap empty. */
+static void
+heap_reset(void)
+{
+ heap_init(&heap);
+ heap_add_region(&heap, (uintptr_t) region, (uintptr_t) region + REGION_SIZE);
+}
+
+static void*
+heap_allocate_block(const size_t size)
+{
+ return heap_allocate(&heap, size);
+}
+
+static void
+heap_free_block(void* const block)
+{
+ heap_free(&heap, block);
+}
+
+/*! Makes the extent heap empty and gives its bookkeeping back. */
+static void
+extent_reset(void)
+{
+ extent_heap_destroy(&extent_heap);
+ if (!extent_heap_add_region(&extent_heap, (uintptr_t) region,
+                             (uintptr_t) region + REGION_SIZE))
+ {
+  fprintf(stderr, "Out of memory\n");
+  exit(1);
+ }
+}
+
+static void*
+extent_allocate_block(const size_t size)
+{
+ return extent_heap_allocate(&extent_heap, size, 0);
+}
+
+static void
+extent_free_block(void* const block)
+{
+ extent_heap_free(&extent_heap, block);
+}
+
+/*! The allocators measured. */
+static const struct allocator allocators[] =
+{
+ {"heap", heap_reset, heap_allocate_block, heap_free_block},
+ {"extent_heap", extent_reset, extent_allocate_block, extent_free_block}
+};
+
+/*! Replays a trace against allocator and prints the results. */
+static void
+replay(const struct trace* const trace,
+       const struct allocator* const allocator)
+{
+ void**   blocks = calloc(trace->slots, sizeof(void*));
+ size_t*  sizes = calloc(trace->slots, sizeof(size_t));
+ size_t   failures = 0;
+ size_t   live = 0;
+ size_t   peak_live = 0;
+ size_t   footprint = 0;
+ uint64_t start;
+ uint64_t elapsed;
+ size_t   i;
+
+ if ((0 == blocks) || (0 == sizes))
+ {
+  fprintf(stderr, "Out of memory\n");
+  exit(1);
+ }
+
+ /* Timed run. */
+ allocator->reset();
+ start = now();
+ for (i = 0; i < trace->length; i++)
+ {
+  const struct operation* const operation = &trace->operations[i];
+
+  if (0 != operation->size)
+   blocks[operation->slot] = allocator->allocate(operation->size);
+  else if (0 != blocks[operation->slot])
+  {
+   allocator->free(blocks[operation->slot]);
+   blocks[operation->slot] = 0;
+  }
+ }
+ elapsed = now() - start;
+
+ /* Run with bookkeeping. The footprint is the distance from the start of
+    the region to the end of the highest block handed out, which is the
+    memory the kernel would have to back. */
+ allocator->reset();
+ for (i = 0; i < trace->length; i++)
+ {
+  const struct operation* const operation = &trace->operations[i];
+  void** const                  block = &blocks[operation->slot];
+
+  if (0 != operation->size)
+  {
+   *block = allocator->allocate(operation->size);
+   if (0 == *block)
+   {
+    failures++;
+    continue;
+   }
+
+   sizes[operation->slot] = operation->size;
+   live += operation->size;
+   if (live > peak_live)
+    peak_live = live;
+   if ((uint8_t*) *block + operation->size - region > footprint)
+    footprint = (uint8_t*) *block + operation->size - region;
+  }
+  else if (0 != *block)
+  {
+   live -= sizes[operation->slot];
+   allocator->free(*block);
+   *block = 0;
+  }
+ }
+
+ printf("%-12s %-16s %8zu %8.1f %10zu %14zu %6.1f%% %8zu\n",
+        allocator->name, trace->name, trace->length, (double) elapsed / trace->length, peak_live / 1024,
+        footprint / 1024,
+        (0 != footprint) ? 100.0 * (footprint - peak_live) / footprint : 0.0,
+        failures);
+
+ free(blocks);
+ free(sizes);
+}
+
+/* Definitions. */
+
+int
+main(int argc, char* argv[])
+{
+ struct trace traces[4];
+ void*        physical;
+ size_t       i;
+ size_t       j;
+
+ physical = mmap((void*) PHYSICAL_ADDRESS, PHYSICAL_SIZE,
+                 PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+ if ((void*) PHYSICAL_ADDRESS != physical)
+ {
+  fprintf(stderr, "Can not map the memory for frames at %#lx\n",
+          (unsigned long) PHYSICAL_ADDRESS);
+  return 1;
+ }
+
+ lowest_available_physical_memory = PHYSICAL_ADDRESS;
+ top_of_available_physical_memory = PHYSICAL_ADDRESS + PHYSICAL_SIZE;
+ initialize();
+ frame_add_memory(lowest_available_physical_memory,
+                  top_of_available_physical_memory);
+
+ region = mmap(0, REGION_SIZE, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+ if (MAP_FAILED == region)
+ {
+  perror("mmap");
+  return 1;
+ }
+
+ program_0_trace(&traces[0]);
+ bursty_trace(&traces[1]);
+ mixed_lifetime_trace(&traces[2]);
+ small_object_trace(&traces[3]);
+
+ /* Fragmentation is the share of the footprint that does not hold live
+    data at the peak. */
+ printf("%-12s %-16s %8s %8s %10s %14s %7s %8s\n", "heap", "trace", "ops",
+        "ns/op", "peak KiB", "footprint KiB", "frag", "failures");
+ for (i = 0; i < sizeof(traces) / sizeof(traces[0]); i++)
+ {
+  for (j = 0; j < sizeof(allocators) / sizeof(allocators[0]); j++)
+   replay(&traces[i], &allocators[j]);
+  free(traces[i].operations);
+ }
+
+ return 0;
+}
@@ -13,8 +13,47 @@
  .global _start
  .global halt_the_machine
  .global sysenter_entry_point
+ .global page_fault_entry_point
+ .global timer_entry_point
+ .global spurious_interrupt_entry_point
+ .global apic_timer_entry_point
+ .global tlb_flush_entry_point
+ .global device_not_available_entry_point
  .global go_to_user_space
  .global kernel_stack
+ .global ap_trampoline
+ .global ap_gdt_pointer
+ .global ap_trampoline_end
+
+ # Saves the registers of a thread interrupted in user space. Used at the
+ # start of the timer interrupt handlers. The processor pushed user space
+ # ss, esp, eflags, cs and eip. The thread is marked so it is resumed with
+ # iret, which restores all of them.
+ .macro save_interrupted_thread
+ push   %eax
+ mov    $16,%eax
+ mov    %ax,%ds
+ mov    %ax,%es
+ mov    %ax,%gs
+ mov    $48,%eax
+ mov    %ax,%fs
+ mov    %fs:4,%eax
+
+ # eax is on the stack
+ popl   (%eax)
+ mov    %ebx,4(%eax)
+ mov    %esi,8(%eax)
+ mov    %edi,12(%eax)
+ mov    %ebp,16(%eax)
+ mov    %ecx,28(%eax)
+ mov    %edx,32(%eax)
+ popl   24(%eax)
+ add    $4,%esp
+ popl   36(%eax)
+ popl   20(%eax)
+ add    $4,%esp
+ movl   $1,40(%eax)
+ .endm
 	
  .text
  # Here be dragons.
@@ -101,9 +140,11 @@ sysenter_entry_point:
  mov    $16,%eax
  mov    %ax,%ds
  mov    %ax,%es
- mov    %ax,%fs
  mov    %ax,%gs
- mov    current_thread,%eax
+ # fs points to the state of this cpu, the current thread is at offset 4
+ mov    $48,%eax
+ mov    %ax,%fs
+ mov    %fs:4,%eax
 
  # Save all necessary registers. Note that eax is on the stack, see above.
  # The system call wrappers used by user programs will place user space esp
@@ -119,8 +160,101 @@ sysenter_entry_point:
 
  jmp    handle_system_call
 
+page_fault_entry_point:
+ # The processor has pushed an error code on top of eflags, cs and eip, and
+ # the user space ss and esp if the fault happened in user space. Save the
+ # registers of the interrupted code as the fault is usually resolved and
+ # the code is resumed.
+ pusha
+ push   %ds
+ push   %es
+ push   %fs
+ push   %gs
+ mov    $16,%eax
+ mov    %ax,%ds
+ mov    %ax,%es
+ mov    %ax,%gs
+ mov    $48,%eax
+ mov    %ax,%fs
+ cld
+
+ # Pass the error code, found above the saved registers, to the handler
+ pushl  48(%esp)
+ call   handle_page_fault
+ add    $4,%esp
+
+ pop    %gs
+ pop    %fs
+ pop    %es
+ pop    %ds
+ popa
+ # Drop the error code
+ add    $4,%esp
+ iret
+
+device_not_available_entry_point:
+ # A thread ran an FPU or SSE instruction while the task switched flag was
+ # set, see fpu_prepare in kernel.c. The kernel does not use the FPU, so
+ # this only happens in user space.
+ testl  $3,4(%esp)
+ jz     halt_the_machine
+
+ save_interrupted_thread
+ jmp    handle_device_not_available
+
+timer_entry_point:
+ # The kernel only enables interrupts while it waits for them. Count the
+ # tick and go back to it.
+ testl  $3,4(%esp)
+ jz     kernel_timer_interrupt
+
+ save_interrupted_thread
+ jmp    handle_timer_interrupt
+
+kernel_timer_interrupt:
+ push   %eax
+ incl   timer_ticks
+ mov    $0x20,%al
+ outb   %al,$0x20
+ pop    %eax
+ iret
+
+apic_timer_entry_point:
+ # The timer of the local APIC drives preemption on all cpus but the boot
+ # cpu. As above, the kernel is only interrupted while it waits.
+ testl  $3,4(%esp)
+ jz     kernel_apic_timer_interrupt
+
+ save_interrupted_thread
+ jmp    handle_apic_timer_interrupt
+
+kernel_apic_timer_interrupt:
+ # Acknowledge through the end of interrupt register of the local APIC
+ movl   $0,0xfee000b0
+ iret
+
+tlb_flush_entry_point:
+ # Another cpu changed the mappings of the address space this cpu has
+ # loaded and waits for the TLB to be flushed. This may interrupt user
+ # space, so only ss is known to hold a kernel selector.
+ push   %eax
+ mov    %cr3,%eax
+ mov    %eax,%cr3
+ lock decl %ss:tlb_flush_pending
+ movl   $0,%ss:0xfee000b0
+ pop    %eax
+ iret
+
+spurious_interrupt_entry_point:
+ # Spurious interrupts are not acknowledged.
+ iret
+
 go_to_user_space:
- mov    current_thread,%eax
+ mov    %fs:4,%eax
+
+ # Threads that were interrupted are resumed with iret
+ cmpl   $0,40(%eax)
+ jne    resume_interrupted_thread
 	
  pushl  (%eax)
  mov    4(%eax),%ebx
@@ -129,6 +263,9 @@ go_to_user_space:
  mov    16(%eax),%ebp
  mov    20(%eax),%ecx
  mov    24(%eax),%edx	
+
+ # Leave the kernel to the other cpus
+ movl   $0,kernel_lock
 		
  # Before executing this code, the value of esp in user space is placed
  # in ecx, the value of eip in user space is plaxed in edx. The value of eax
@@ -139,7 +276,82 @@ go_to_user_space:
  mov    %ax,%fs
  mov    %ax,%gs
  pop    %eax
+ # Interrupts are enabled in user space. They are only recognized after
+ # the instruction following sti.
+ sti
  sysexit
+
+resume_interrupted_thread:
+ movl   $0,40(%eax)
+
+ # Build the frame iret expects: user space ss, esp, eflags, cs and eip
+ pushl  $35
+ pushl  20(%eax)
+ pushl  36(%eax)
+ pushl  $27
+ pushl  24(%eax)
+
+ # Read all of the thread before another cpu may change it. eax is staged
+ # on the stack as it points to the thread.
+ pushl  (%eax)
+ mov    4(%eax),%ebx
+ mov    8(%eax),%esi
+ mov    12(%eax),%edi
+ mov    16(%eax),%ebp
+ mov    28(%eax),%ecx
+ mov    32(%eax),%edx
+
+ # Leave the kernel to the other cpus
+ movl   $0,kernel_lock
+
+ mov    $35,%eax
+ mov    %ax,%ds
+ mov    %ax,%es
+ mov    %ax,%fs
+ mov    %ax,%gs
+ pop    %eax
+ iret
+
+ # The application processors start here in real mode, at the address
+ # named by the startup interprocessor interrupt. smp_init copies this code
+ # there and fills in ap_gdt_pointer with the descriptor table of the boot
+ # cpu, whose segments are flat.
+ .code16
+ap_trampoline:
+ cli
+ xor    %ax,%ax
+ mov    %ax,%ds
+ lgdtl  ap_gdt_pointer - ap_trampoline + 0x8000
+ mov    %cr0,%eax
+ or     $1,%eax
+ mov    %eax,%cr0
+ ljmpl  $8,$ap_entry_point
+ .align 4
+ap_gdt_pointer:
+ .word  0
+ .long  0
+ap_trampoline_end:
+ .code32
+
+ap_entry_point:
+ mov    $16,%eax
+ mov    %ax,%ds
+ mov    %ax,%es
+ mov    %ax,%ss
+
+ # Take the next cpu id. Cpus beyond smp_max_cpus or without a stack are
+ # left halted.
+ mov    $1,%ecx
+ lock xadd %ecx,next_cpu_id
+ cmp    smp_max_cpus,%ecx
+ jae    halt_the_machine
+ mov    cpu_stacks(,%ecx,4),%esp
+ test   %esp,%esp
+ jz     halt_the_machine
+
+ push   %ecx
+ call   ap_init
+ jmp    halt_the_machine
 	
  .data
  .bss
@@ -12,16 +12,41 @@
 #include <sysdefines.h>
 
 #include "mm.h"
+#include "vm.h"
+#include "timer.h"
+#include "smp.h"
 
 /* First some declarations for data structures and functions found in the
    assembly code or the linker script. */
 
-/*! Entry point into the kernel for system calls via sysenter. */
-extern uint8_t sysenter_entry_point[];
+/*! Entry point into the kernel for page faults. */
+extern uint8_t page_fault_entry_point[];
 
-/*! The kernel stack used when in the kernel. */
+/*! Entry point into the kernel for timer interrupts. */
+extern uint8_t timer_entry_point[];
+
+/*! Entry point into the kernel for spurious interrupts. */
+extern uint8_t spurious_interrupt_entry_point[];
+
+/*! Entry point into the kernel for interrupts of the local APIC timer. */
+extern uint8_t apic_timer_entry_point[];
+
+/*! Entry point into the kernel for TLB flush requests from other cpus. */
+extern uint8_t tlb_flush_entry_point[];
+
+/*! Entry point into the kernel for FPU and SSE instructions run while the
+    state of another thread is loaded. */
+extern uint8_t device_not_available_entry_point[];
+
+/*! The kernel stack used by the boot cpu when in the kernel. */
 extern uint8_t kernel_stack[];
 
+/*! Points to the first byte of the kernel image. */
+extern uint8_t start_of_kernel[];
+
+/*! Points to after the last byte of the kernel bss segment. */
+extern uint8_t end_of_bss[];
+
 /*! Points to after the last byte used by the embedded
     executable applications. */
 extern uint8_t end_of_applications[];
@@ -64,6 +89,37 @@ uintptr_t lowest_available_physical_memory;
 /*! This points to the highest address of memory you will manage */
 uintptr_t top_of_available_physical_memory;
 
+struct process;
+struct thread;
+
+/*! Defines a first in, first out queue of threads. */
+struct thread_queue
+{
+ struct thread* head; /*!< The thread to leave the queue next. */
+ struct thread* tail; /*!< The thread that entered the queue last. */
+ uint32_t       length; /*!< Number of threads in the queue. */
+};
+
+/*! The thread is running or in a ready queue. */
+#define THREAD_RUNNABLE   (0)
+
+/*! The thread is blocked in SYSCALL_WAIT. */
+#define THREAD_WAITING    (1)
+
+/*! The thread is blocked in SYSCALL_SEND until its partner receives the
+    message. */
+#define THREAD_SENDING    (2)
+
+/*! The thread is blocked in SYSCALL_RECEIVE until a message arrives. */
+#define THREAD_RECEIVING  (3)
+
+/*! The message of the thread was received and it is blocked in
+    SYSCALL_SEND until its partner replies. */
+#define THREAD_REPLY_WAIT (4)
+
+/*! The thread is blocked in SYSCALL_WAIT_CHILD. */
+#define THREAD_CHILD_WAIT (5)
+
 /*! Defines a thread. */
 struct thread
 {
@@ -74,10 +130,64 @@ struct thread
  uint32_t ebp;
  uint32_t esp;
  uint32_t eip;
+ uint32_t ecx;
+ uint32_t edx;
+ uint32_t eflags;
+ uint32_t interrupted; /*!< Set when the thread was stopped by an interrupt
+                            rather than a system call. It is then resumed
+                            with all registers restored. */
  /* The above members must be the first in the struct. Do not change the
     order. */
+ struct process* process; /*!< The process the thread belongs to. */
+ struct thread*  next;    /*!< Next thread in the queue the thread is in. */
+ uint32_t        priority; /*!< Level of the ready queue the thread goes
+                                into, 0 being the highest. */
+ uint32_t        base_priority; /*!< Highest level the thread can reach. It
+                                     is set through SYSCALL_SET_PRIORITY. */
+ uint32_t        cpu;     /*!< The cpu whose ready queues the thread goes
+                               into. */
+ struct thread*  sibling; /*!< Next thread in the same process. */
+ void*           stack;   /*!< The user stack the kernel allocated for the
+                               thread, or 0 if the program set up its own. */
+ void*           fpu_state; /*!< FPU and SSE registers of the thread in the
+                                 format of fxsave, or 0 if the thread has
+                                 not used them. */
+ const struct address_space* wait_space; /*!< The address space
+                                              wait_address is in, or 0 if
+                                              it is a physical address. */
+ uintptr_t       wait_address; /*!< The word the thread waits on in
+                                    SYSCALL_WAIT, see wait_key, or the id of
+                                    the child it waits for in
+                                    SYSCALL_WAIT_CHILD, 0 meaning any. */
+ uint32_t        id;      /*!< Identifies the thread to the IPC system
+                               calls. */
+ struct thread*  hash_next; /*!< Next thread in the same bucket of
+                                 thread_table. */
+ uint32_t        state;   /*!< THREAD_RUNNABLE, or what the thread is
+                               blocked in. */
+ struct thread*  partner; /*!< The thread a sending thread waits for. */
+ struct thread_queue senders; /*!< Threads blocked sending to this thread,
+                                   in the order they sent. */
+ struct thread_queue callers; /*!< Threads whose message this thread
+                                   received, waiting for its reply. */
+};
+
+/*! Defines a range of physical memory. */
+struct memory_region
+{
+ uintptr_t start; /*!< The first byte of the region. */
+ uintptr_t end;   /*!< Points to after the last byte of the region. */
 };
 
+/*! Maximum number of usable memory regions taken from the boot loader. */
+#define MAX_MEMORY_REGIONS (32)
+
+/*! Usable memory regions reported by the boot loader. */
+static struct memory_region memory_regions[MAX_MEMORY_REGIONS];
+
+/*! Number of entries used in memory_regions. */
+static int memory_region_count;
+
 /*! Size of the array that holds starting addresses of applications */
 #define EXECUTABLE_TABLE_SIZE (3)
 
@@ -88,20 +198,145 @@ uintptr_t executable_table[EXECUTABLE_TABLE_SIZE] =
  {(uintptr_t)exec_0_start,
   (uintptr_t)exec_1_start,
   (uintptr_t)exec_2_start};
-  
+
+/*! Each application is linked to run from its own slot of this many bytes,
+    starting at its entry in executable_table. */
+#define EXECUTABLE_SLOT_SIZE (0x20000)
+
+/*! The code of an application is found in the first this many bytes of its
+    slot. Data, bss and the stack are found in the rest. */
+#define EXECUTABLE_TEXT_SIZE (0x10000)
+
+/*! Order of the frame blocks holding the initial data of an application. */
+#define EXECUTABLE_DATA_ORDER (4)
+
+/*! Number of entries in the interrupt descriptor table. */
+#define IDT_ENTRIES (256)
+
+/*! Interrupt vector of page faults. */
+#define PAGE_FAULT_VECTOR (14)
+
+/*! Bit in the page fault error code that is set if the fault happened in
+    user space. */
+#define PAGE_FAULT_USER (0x4)
+
+/*! Interrupt vector of the fault raised by FPU and SSE instructions while
+    the task switched flag is set. */
+#define DEVICE_NOT_AVAILABLE_VECTOR (7)
+
+/*! Monitor coprocessor flag in cr0. Makes wait instructions honour the task
+    switched flag. */
+#define CR0_MP (0x00000002)
+
+/*! Emulation flag in cr0. Makes all FPU instructions fault. */
+#define CR0_EM (0x00000004)
+
+/*! Task switched flag in cr0. Makes the next FPU or SSE instruction fault. */
+#define CR0_TS (0x00000008)
+
+/*! Flag in cr4 enabling fxsave, fxrstor and the SSE instructions. */
+#define CR4_OSFXSR (0x00000200)
+
+/*! Flag in cr4 reporting unmasked SSE exceptions as such. */
+#define CR4_OSXMMEXCPT (0x00000400)
+
+/*! Bit in edx of cpuid leaf 1 set if fxsave and fxrstor are supported. */
+#define CPUID_FXSR (0x01000000)
+
+/*! Bit in edx of cpuid leaf 1 set if SSE is supported. */
+#define CPUID_SSE (0x02000000)
+
+/*! Bit in ecx of cpuid leaf 1 set if monitor and mwait are supported. */
+#define CPUID_MONITOR (0x00000008)
+
+/*! Size of the area fxsave writes. */
+#define FPU_STATE_SIZE (512)
+
+/*! Value of the FPU control word after fninit. All exceptions are masked. */
+#define FPU_CONTROL_DEFAULT (0x037f)
+
+/*! Value of the SSE control and status register after reset. All
+    exceptions are masked. */
+#define MXCSR_DEFAULT (0x1f80)
+
+/*! The interrupt descriptor table. Each gate takes two words. */
+static uint32_t idt[2 * IDT_ENTRIES];
+
+/*! Copies of the data parts of all applications as they were loaded. Each
+    process gets its own copy of them, so processes do not see changes made
+    by earlier runs of the same application. */
+static void* executable_data[EXECUTABLE_TABLE_SIZE];
+
 /*! Clears the screen */
 extern void cls();
 
-/*! Maximum number of threads in the system. */
-#define MAX_THREADS 256
-
-/*! All threads in the system. */
-extern struct thread threads[MAX_THREADS];
-struct thread threads[MAX_THREADS];
+/*! Cache holding all threads in the system. */
+extern struct object_cache thread_cache;
+struct object_cache thread_cache;
 
 /*! The current thread running on the cpu. */
-extern struct thread* current_thread;
-struct thread* current_thread = &threads[0];
+#define current_thread (this_cpu()->thread)
+
+/*! Cache holding the FPU and SSE state of the threads that use them. The
+    objects are aligned to CACHE_LINE_SIZE, which fxsave needs. */
+extern struct object_cache fpu_state_cache;
+struct object_cache fpu_state_cache;
+
+/*! Set if the processor has fxsave and fxrstor. Threads can not use the FPU
+    otherwise. */
+static int fpu_available;
+
+/*! Set if the processor has monitor and mwait. Idle cpus use them instead
+    of hlt. */
+static int mwait_available;
+
+/*! Threads that are ready to run, one queue per cpu and priority level.
+    The threads in the highest non-empty level of a cpu get the cpu in
+    turn. A cpu with no ready threads takes one from the cpu with the most
+    ready threads. */
+static struct thread_queue ready_queues[MAX_CPUS][PRIORITY_LEVELS];
+
+/*! Number of queues in wait_queues. Must be a power of two. */
+#define WAIT_QUEUE_BUCKETS (64)
+
+/*! Threads blocked in SYSCALL_WAIT, hashed on the key of the word they
+    wait on. Threads waiting on different words may share a queue. */
+static struct thread_queue wait_queues[WAIT_QUEUE_BUCKETS];
+
+/*! Number of buckets in thread_table. Must be a power of two. */
+#define THREAD_TABLE_BUCKETS (64)
+
+/*! All threads, hashed on their id and linked through hash_next. */
+static struct thread* thread_table[THREAD_TABLE_BUCKETS];
+
+/*! The id to try first for the next thread. */
+static uint32_t next_thread_id = 1;
+
+/*! Number of timer interrupts per second. */
+#ifndef TIMER_FREQUENCY
+#define TIMER_FREQUENCY (1000)
+#endif
+
+/*! Number of timer interrupts a thread at the highest priority may run
+    for before the next ready thread gets the cpu. The time slice doubles
+    with each level down, so threads that compute for long are switched
+    less often. */
+#ifndef TIME_SLICE
+#define TIME_SLICE (10)
+#endif
+
+/*! Number of timer interrupts between the moves of all ready threads back
+    to their base priority, so threads at low levels are not starved. */
+#ifndef PRIORITY_BOOST_INTERVAL
+#define PRIORITY_BOOST_INTERVAL (1000)
+#endif
+
+/*! Number of timer interrupts left of the time slice of the current
+    thread of each cpu. */
+static uint32_t time_slice_left[MAX_CPUS];
+
+/*! Value of timer_ticks at the last priority boost. */
+static uint32_t last_priority_boost;
 
 /*! Initializes the kernel. */
 extern void kernel_init(register uint32_t* const multiboot_information)
@@ -110,216 +345,2392 @@ extern void kernel_init(register uint32_t* const multiboot_information)
 /*! Handles one system call. */
 extern void handle_system_call(void);
 
-/*! Maximum number of threads in the system. */
-#define MAX_PROCESSES 256
+/*! Handles a page fault. Returns if the faulting instruction can be
+    restarted. */
+extern void handle_page_fault(const uint32_t error_code);
 
-/* Defines a process */
-struct process {
-  struct thread proc_thread;
-  // address space??
-};
+/*! Handles an FPU or SSE instruction run while the registers of another
+    thread are loaded. */
+extern void handle_device_not_available(void);
 
-/*! All processes in the system. */
-extern struct process processes[MAX_PROCESSES];
-struct process processes[MAX_PROCESSES];
+/*! Handles a timer interrupt in user space. */
+extern void handle_timer_interrupt(void);
 
-/*! The current process */
-extern struct process* current_process;
-struct process* current_process = &processes[0];
+/*! Handles an interrupt of the local APIC timer in user space. */
+extern void handle_apic_timer_interrupt(void);
 
-extern int numOfProcesses;
-extern int programNum;
+/*! Initializes an application processor. Called by entry.s with the id
+    of the cpu. */
+extern void ap_init(const uint32_t id) __attribute__ ((noreturn));
 
-/* Definitions. */
-int numOfProcesses = 0;
-int programNum = 0;
+/*! Carries out the operations queued in the submission rings of all
+    processes. Called by cpus with nothing to run. */
+static int async_poll(void);
 
-/* Definitions. */
+/*! Queues the completions of the timeouts that have expired. */
+static void async_expire_timers(void);
 
-void kernel_init(register uint32_t* const multiboot_information
-                                          /*!< Points to a multiboot
-                                               information structure. */)
+/* Defines a process */
+struct process
 {
- /* The Multiboot specification dictates that a boot loader will leave
-    information in memory for the kernel to use, see
-    http://www.gnu.org/software/grub/manual/multiboot . We go through the
-    information and extract the information we need. We also sanity check. */
+ struct thread*  threads; /*!< The threads running in the process, linked
+                               through their sibling member. */
+ struct address_space* address_space; /*!< The memory mappings of the
+                                          process and the memory it
+                                          allocated. */
+ int             terminating; /*!< Set when the process is terminated
+                                   while some of its threads run on other
+                                   cpus. They terminate themselves the next
+                                   time they enter the kernel. */
+ uint32_t        id;      /*!< Identifies the process. It is the id of its
+                               first thread, so messages sent to it reach
+                               that thread. */
+ struct process* parent;  /*!< The process that created this one, or 0 once
+                               that has terminated. */
+ struct process* children; /*!< Processes created by this one that it has
+                                not waited for, linked through sibling. */
+ struct process* sibling; /*!< Next child of the same parent. */
+ struct thread_queue child_waiters; /*!< Threads blocked in
+                                         SYSCALL_WAIT_CHILD. */
+ int32_t         exit_status; /*!< Passed to SYSCALL_TERMINATE by the last
+                                   thread, or EXIT_STATUS_KILLED. */
+ int             exited;  /*!< Set once all threads have terminated. The
+                               control block is kept for the exit status
+                               until the parent waits for the process. */
+ uintptr_t       async_rings; /*!< Address of the rings set up with
+                                   SYSCALL_ASYNC_SETUP, or 0. */
+ uint32_t        async_entries; /*!< Number of submission entries of the
+                                     rings. The kernel relies on this
+                                     rather than the header, which the
+                                     process can write. */
+ struct thread*  async_owner; /*!< The thread that set up the rings.
+                                   Replies queued in them are given on its
+                                   behalf. 0 once it has terminated. */
+ struct process* async_next; /*!< Next process with rings. */
+};
 
- /* Check if the boot loader left information on memory. */
- if (!(1 & *multiboot_information))
-  halt_the_machine();
+/*! Defines a timeout queued with ASYNC_TIMEOUT. */
+struct async_timer
+{
+ struct async_timer* next;      /*!< The timer expiring next. */
+ struct process*     process;   /*!< The process that queued it. */
+ uint32_t            deadline;  /*!< Value of timer_ticks at which it
+                                     expires. */
+ uint32_t            user_data; /*!< Handed back in the completion. */
+};
 
- /* Extract information on how much memory is available in the machine. */
- top_of_available_physical_memory =
-  ((uintptr_t)(*(multiboot_information+2) + 1024)) * 1024;
- lowest_available_physical_memory = (uintptr_t) end_of_applications;
+/*! Offset of the submission entries from the header of the rings. */
+#define ASYNC_SUBMISSIONS ((sizeof(struct async_rings) + \
+                            sizeof(struct async_submission) - 1) & \
+                           ~(sizeof(struct async_submission) - 1))
 
- /* Initialize the memory system. */
- initialize();
+/*! Offset of the completion entries from the header of rings with entries
+    submission entries. */
+#define ASYNC_COMPLETIONS(entries) \
+ (ASYNC_SUBMISSIONS + (entries) * sizeof(struct async_submission))
 
- /* Check if we can use sysenter/sysret. It is highly likely that sysenter
-    is supported, it has been since Pentium 2, so this is really a sanity
-    check. */
- {
-  uint32_t eax, ebx, ecx, edx;
+/*! Size of rings with entries submission entries. */
+#define ASYNC_SIZE(entries) \
+ (ASYNC_COMPLETIONS(entries) + 2 * (entries) * sizeof(struct async_completion))
 
-  cpuid(1, &eax, &ebx, &ecx, &edx);
+/*! Processes with rings, linked through async_next. */
+static struct process* async_processes;
 
-  /* Check if the processor says it supports sysenter. */
-  if (!(0x800 & edx))
-   halt_the_machine();
+/*! Timeouts queued with ASYNC_TIMEOUT, the one expiring first at the
+    head. */
+static struct async_timer* async_timers;
 
-  /* Pentium Pro has a bug in that it errouneously says it supports
-     sysenter. Check if we are running on processor such as Pentium
-     Pro which does not support sysenter. */
-  if ((((eax & 0x00000F00) >> 8) == 6) &&
-     (((eax & 0x000000F0) >> 4) < 3) &&
-     ((eax & 0x0000000F) < 3))
-   halt_the_machine();
- }
+/*! Cache holding the timeouts. */
+extern struct object_cache async_timer_cache;
+struct object_cache async_timer_cache;
 
- /* Set up segment selectors. This is a x86 specific concept. Selectors
-    are used to control execution modes of the processor and to control
-    how data is accessed. Selectors are controlled through the GDT. The
-    processor has to be given the size and pointer to the GDT. */
- {
-  const static uint32_t gdt[10] = {0, 0, /* null */
-                                   0xffff, 0x00cf9a00, /* kernel code */
-                                   0xffff, 0x00cf9200, /* kernel data */
-                                   0xffff, 0x00cffa00, /* user code */
-                                   0xffff, 0x00cff200  /* user data */};
-
-  /* Install it. */
-  lgdt(sizeof(gdt) - 1, (uintptr_t) gdt);
-  /* Install the local descriptor table. This is related to the GDT and
-     installed as a safety/stability precaution. */
-  lldt(0);
-
-  /* Make the processor use the new GDT. */
-  __asm volatile ("mov %%bx, %%ds\n \
-                   mov %%bx, %%es\n \
-                   mov %%bx, %%fs\n \
-                   mov %%bx, %%gs\n \
-                   mov %%bx, %%ss\n \
-                   ljmp $8,$1f\n \
-                   1:" : : "b" (16) :);
- }
-
- /* Set up support for sysenter. */
- /* The base code segment selector. This is used to set the other selectors. */
- wrmsr(0x174, 8, 0);
- /* Kernel stack pointer. We keep the top 4 bytes set to zero to keep GDB
-    happy. */
- wrmsr(0x175, (uintptr_t)kernel_stack - 4, 0);
- /* The entry point for sysenter. We will end up there at system calls. */
- wrmsr(0x176, (uintptr_t)sysenter_entry_point, 0);
+/*! Allocation counters and latency histograms kept for
+    SYSCALL_MEMORY_STATISTICS. The heap figures are filled in when a
+    snapshot is taken. */
+static struct memory_statistics memory_statistics;
 
- /* clear the screen (Nicklas' edit) */
- cls();
- kprints("The kernel has booted!\n");
+/*! Cache holding all processes in the system. */
+extern struct object_cache process_cache;
+struct object_cache process_cache;
+
+/*! The current process */
+#define current_process (this_cpu()->process)
 
- current_process->proc_thread = threads[0];
- current_thread = &current_process->proc_thread;
- current_thread->eip = executable_table[0];
- 
+/*! Adds [start, end) to the usable memory regions, leaving out memory
+    below 1 MiB, which holds BIOS data, and memory that is not identity
+    mapped. */
+static void
+add_memory_region(const uint64_t start, uint64_t end)
+{
+ if (end > USER_HEAP_START)
+  end = USER_HEAP_START;
 
- /* Set up the first thread. For now we do not set up a process. That is
-   for you to do later. */
- //threads[0].eip = executable_table[0];
+ if ((end <= 0x100000) || (start >= end) ||
+     (memory_region_count == MAX_MEMORY_REGIONS))
+  return;
 
- 
- /* Go to user space. */
- go_to_user_space();
+ memory_regions[memory_region_count].start =
+  (start < 0x100000) ? 0x100000 : (uintptr_t) start;
+ memory_regions[memory_region_count].end = (uintptr_t) end;
+ memory_region_count++;
 }
 
-void handle_system_call(void)
+/*! Collects the usable memory regions from the multiboot information
+    structure. The memory map is used when the boot loader provides it.
+    Otherwise all memory from 1 MiB up to the amount reported in mem_upper
+    is assumed to be usable. */
+static void
+find_memory_regions(const uint32_t* const multiboot_information)
 {
- switch (current_thread->eax)
+ if (0x40 & *multiboot_information)
  {
-  case SYSCALL_VERSION:
+  /* Each entry holds its size, not counting the size field itself,
+     followed by a 64-bit base, a 64-bit length and a type. Type 1 is
+     usable RAM. */
+  const uintptr_t mmap_start = multiboot_information[12];
+  const uintptr_t mmap_end   = mmap_start + multiboot_information[11];
+  uintptr_t       entry;
+
+  for (entry = mmap_start; entry < mmap_end;
+       entry += *(const uint32_t*) entry + 4)
   {
-   current_thread->eax = 0x00010000;
-   break;
+   const uint32_t* const fields = (const uint32_t*) entry;
+   const uint64_t        base   = fields[1] | ((uint64_t) fields[2] << 32);
+   const uint64_t        length = fields[3] | ((uint64_t) fields[4] << 32);
+
+   if (1 == fields[5])
+    add_memory_region(base, base + length);
   }
+ }
+ else
+  add_memory_region(0x100000,
+                    ((uint64_t) multiboot_information[2] + 1024) * 1024);
+}
 
-  case SYSCALL_PRINTS:
+/*! Hands all usable memory, except the kernel image, the embedded
+    applications and what the memory system uses for itself, to the page
+    frame allocator. */
+static void
+add_available_memory(void)
+{
+ const uintptr_t reserved_start = (uintptr_t) start_of_kernel;
+ const uintptr_t reserved_end   = lowest_available_physical_memory;
+ int             i;
+
+ for (i = 0; i < memory_region_count; i++)
+ {
+  const uintptr_t start = memory_regions[i].start;
+  const uintptr_t end   = memory_regions[i].end;
+
+  if ((end <= reserved_start) || (start >= reserved_end))
+   frame_add_memory(start, end);
+  else
   {
-   /*kprints("SYSCALL_PRINTS WAS CALLED!\n");*/
-  //krpints string argument fra %edi
-   kprints((char *)current_thread->edi);
-   break;
+   if (start < reserved_start)
+    frame_add_memory(start, reserved_start);
+   if (end > reserved_end)
+    frame_add_memory(reserved_end, end);
   }
+ }
+}
 
-  case SYSCALL_CREATEPROCESS:
-  {
-    //kprints("SYSCALL_CREATEPROCESS WAS CALLED!\n");
-    /*
-      One system call, createprocess, creates a new process with a single thread
-      The createprocess system call takes a parameter in the edi register . This parameter is
-      an integer which is an index into the array of executable programs. The program will be
-      started as a process by the system call.
-    */
-    // when thread is created, all registers in it must be initialized
-    
-    // Increment process counter
-    numOfProcesses++;
+/*! Returns the thread with the given id, or 0 if there is none. */
+static struct thread*
+find_thread(const uint32_t id)
+{
+ struct thread* thread = thread_table[id & (THREAD_TABLE_BUCKETS - 1)];
+
+ while ((0 != thread) && (thread->id != id))
+  thread = thread->hash_next;
+
+ return thread;
+}
+
+/*! Gives a new thread an id not in use and makes it known to the IPC
+    system calls. Ids are positive so they can be told from error codes. */
+static void
+register_thread(struct thread* const thread)
+{
+ struct thread** bucket;
 
-    // Giv den næste proces den næste tråd
-    processes[numOfProcesses].proc_thread = threads[numOfProcesses];
+ do
+ {
+  thread->id = next_thread_id;
+  next_thread_id = (next_thread_id < INT32_MAX) ? next_thread_id + 1 : 1;
+ } while (0 != find_thread(thread->id));
+
+ thread->state = THREAD_RUNNABLE;
+ thread->partner = 0;
+ thread->senders.head = 0;
+ thread->senders.tail = 0;
+ thread->senders.length = 0;
+ thread->callers = thread->senders;
+
+ bucket = &thread_table[thread->id & (THREAD_TABLE_BUCKETS - 1)];
+ thread->hash_next = *bucket;
+ *bucket = thread;
+}
+
+/*! Gives a new process, whose first thread is registered, its id and
+    makes it a child of the current process, if there is one. */
+static void
+link_process(struct process* const process)
+{
+ process->id = process->threads->id;
+ process->parent = current_process;
+ process->children = 0;
+ process->child_waiters.head = 0;
+ process->child_waiters.tail = 0;
+ process->child_waiters.length = 0;
+ process->exit_status = 0;
+ process->exited = 0;
+ process->async_rings = 0;
+ process->async_entries = 0;
+ process->async_owner = 0;
+
+ process->sibling = 0;
+ if (0 != process->parent)
+ {
+  process->sibling = process->parent->children;
+  process->parent->children = process;
+ }
+}
 
-    // Sæt current_process til den nye proces
-    current_process = &processes[numOfProcesses];
+/*! Creates a process running executable number executable with a single
+    thread. Returns 0 if there is no memory for the control blocks. */
+static struct process*
+create_process(const uint32_t executable)
+{
+ struct process* const process = object_cache_allocate(&process_cache);
+ struct thread*        thread;
 
-    // Aflæs hvilket program der skal startes
-    programNum = current_thread->edi;
+ if (0 == process)
+  return 0;
 
-    // Return ALL_OK or ERROR
-    current_thread->eax = ALL_OK;
-    //current_thread->eax = ERROR;
+ thread = object_cache_allocate(&thread_cache);
+ if (0 == thread)
+ {
+  object_cache_free(&process_cache, process);
+  return 0;
+ }
 
-    // Sæt current_thread til current_process' tråd
-    current_thread = &current_process->proc_thread;
+ process->address_space = address_space_create();
+ if (0 == process->address_space)
+ {
+  object_cache_free(&thread_cache, thread);
+  object_cache_free(&process_cache, process);
+  return 0;
+ }
 
-    // Indlæs program i current_thread
-    current_thread->eip = executable_table[programNum];    
+ /* Map the application into the new address space. The code is shared by
+    all processes running the application and can not be written. The rest
+    of the slot is a private copy of the initial data. */
+ {
+  const uintptr_t slot = executable_table[executable];
+  uintptr_t       offset;
 
-    break;
-  }
+  for (offset = 0; offset < EXECUTABLE_TEXT_SIZE; offset += PAGE_SIZE)
+   if (!address_space_map(process->address_space, slot + offset,
+                          slot + offset, PAGE_USER))
+    goto out_of_memory;
 
-/*
-terminates the current thread as well as process if it has no other threads.
-The terminate system call terminates the currently running thread. The system call
-does not take any parameters and will never return to the caller. It does thus not return
-any values.
-*/
-  case SYSCALL_TERMINATE:
+  for (offset = EXECUTABLE_TEXT_SIZE; offset < EXECUTABLE_SLOT_SIZE;
+       offset += PAGE_SIZE)
   {
-    numOfProcesses--;
+   uint32_t* const       frame = frame_allocate(0);
+   const uint32_t* const data  =
+    (const uint32_t*) ((uintptr_t) executable_data[executable] + offset -
+                       EXECUTABLE_TEXT_SIZE);
+   int                   i;
 
-    // Sæt current_process til den næste proces i "stakken"
-    current_process = &processes[numOfProcesses];
+   if (0 == frame)
+    goto out_of_memory;
 
-    // Sæt current_thread til current_process' tråd
-    current_thread = &current_process->proc_thread;
+   for (i = 0; i < PAGE_SIZE / sizeof(uint32_t); i++)
+    frame[i] = data[i];
 
-    break;
-  }
-  
-  /*
-   * 
-   */
-   case SYSCALL_ALLOCATE: 
+   if (!address_space_map(process->address_space, slot + offset,
+                          (uintptr_t) frame,
+                          PAGE_USER | PAGE_WRITABLE | PAGE_OWNED))
    {
-	   kprints("SYSCALL ALLOCATE WAS CALLED\n");
-	   break;
+    frame_free(frame, 0);
+    goto out_of_memory;
    }
+  }
+ }
 
-  default:
+ /* The startup code sets up the stack, all that matters is eip. */
+ thread->eax = 0;
+ thread->ebx = 0;
+ thread->esi = 0;
+ thread->edi = 0;
+ thread->ebp = 0;
+ thread->esp = 0;
+ thread->eip = executable_table[executable];
+ thread->ecx = 0;
+ thread->edx = 0;
+ thread->eflags = 0;
+ thread->interrupted = 0;
+ thread->process = process;
+ thread->priority = 0;
+ thread->base_priority = 0;
+ thread->cpu = this_cpu()->id;
+ thread->sibling = 0;
+ thread->stack = 0;
+ thread->fpu_state = 0;
+ register_thread(thread);
+
+ process->threads = thread;
+ process->terminating = 0;
+ link_process(process);
+
+ return process;
+
+out_of_memory:
+ address_space_destroy(process->address_space);
+ object_cache_free(&thread_cache, thread);
+ object_cache_free(&process_cache, process);
+ return 0;
+}
+
+/*! Creates a copy of the current process with a single thread. The thread
+    continues from the same point as the current thread. The stacks of the
+    other threads of the current process are copied but not used. Returns 0
+    if memory is exhausted. */
+static struct process*
+fork_process(void)
+{
+ struct process* const process = object_cache_allocate(&process_cache);
+ struct thread*        thread;
+
+ if (0 == process)
+  return 0;
+
+ thread = object_cache_allocate(&thread_cache);
+ if (0 == thread)
+ {
+  object_cache_free(&process_cache, process);
+  return 0;
+ }
+
+ process->address_space = address_space_clone(current_process->address_space);
+ if (0 == process->address_space)
+ {
+  object_cache_free(&thread_cache, thread);
+  object_cache_free(&process_cache, process);
+  return 0;
+ }
+
+ *thread = *current_thread;
+ thread->process = process;
+ thread->sibling = 0;
+
+ /* The copy gets its own FPU and SSE state. The registers of the current
+    thread are written back first if they are loaded. */
+ if (0 != current_thread->fpu_state)
+ {
+  const uint32_t* const from = current_thread->fpu_state;
+  uint32_t*             to;
+  int                   i;
+
+  thread->fpu_state = object_cache_allocate(&fpu_state_cache);
+  if (0 == thread->fpu_state)
   {
-   /* Unrecognized system call. Not good. */
-   current_thread->eax = ERROR_ILLEGAL_SYSCALL;
+   address_space_destroy(process->address_space);
+   object_cache_free(&thread_cache, thread);
+   object_cache_free(&process_cache, process);
+   return 0;
   }
+
+  if (this_cpu()->fpu_owner == current_thread)
+   fxsave(current_thread->fpu_state);
+
+  to = thread->fpu_state;
+  for (i = 0; i < FPU_STATE_SIZE / sizeof(uint32_t); i++)
+   to[i] = from[i];
  }
 
- go_to_user_space();
-}
\ No newline at end of file
+ register_thread(thread);
+
+ process->threads = thread;
+ process->terminating = 0;
+ link_process(process);
+
+ return process;
+}
+
+/*! Creates a thread in the current process that starts at entry with a
+    stack of stack_size bytes. The stack is allocated in the heap of the
+    process. The thread gets the base priority of the current thread.
+    Returns 0 if memory is exhausted. */
+static struct thread*
+create_thread(const uint32_t entry, const uint32_t stack_size)
+{
+ struct thread* const thread = object_cache_allocate(&thread_cache);
+
+ if (0 == thread)
+  return 0;
+
+ /* The stack is zeroed so a thread returning from its entry point jumps
+    to address 0 and is terminated on the page fault. */
+ thread->stack = arena_allocate(current_process->address_space, stack_size,
+                                0, 1);
+ if (0 == thread->stack)
+ {
+  object_cache_free(&thread_cache, thread);
+  return 0;
+ }
+
+ thread->eax = 0;
+ thread->ebx = 0;
+ thread->esi = 0;
+ thread->edi = 0;
+ thread->ebp = 0;
+ /* The stack is aligned as if entry had been called, with esp + 4 at a
+    multiple of 16, as code using SSE expects. */
+ thread->esp = (((uintptr_t) thread->stack + stack_size) & ~(uintptr_t) 15) -
+               sizeof(uint32_t);
+ thread->eip = entry;
+ thread->ecx = 0;
+ thread->edx = 0;
+ thread->eflags = 0;
+ thread->interrupted = 0;
+ thread->process = current_process;
+ thread->priority = current_thread->base_priority;
+ thread->base_priority = current_thread->base_priority;
+ thread->cpu = this_cpu()->id;
+ thread->fpu_state = 0;
+ register_thread(thread);
+
+ thread->sibling = current_process->threads;
+ current_process->threads = thread;
+
+ return thread;
+}
+
+/*! Adds a thread to the end of a queue. */
+static void
+thread_queue_enqueue(struct thread_queue* const queue,
+                     struct thread* const thread)
+{
+ thread->next = 0;
+ if (0 != queue->tail)
+  queue->tail->next = thread;
+ else
+  queue->head = thread;
+ queue->tail = thread;
+ queue->length++;
+}
+
+/*! Removes the thread at the head of a queue. Returns 0 if the queue is
+    empty. */
+static struct thread*
+thread_queue_dequeue(struct thread_queue* const queue)
+{
+ struct thread* const thread = queue->head;
+
+ if (0 != thread)
+ {
+  queue->head = thread->next;
+  if (0 == queue->head)
+   queue->tail = 0;
+  queue->length--;
+ }
+
+ return thread;
+}
+
+/*! Removes a thread from a queue. previous is the thread in front of it,
+    or 0 if it is at the head. */
+static void
+thread_queue_remove(struct thread_queue* const queue,
+                    struct thread* const previous,
+                    struct thread* const thread)
+{
+ if (0 != previous)
+  previous->next = thread->next;
+ else
+  queue->head = thread->next;
+ if (queue->tail == thread)
+  queue->tail = previous;
+ queue->length--;
+}
+
+/*! Removes a thread from a queue it is known to be in. */
+static void
+thread_queue_unlink(struct thread_queue* const queue,
+                    struct thread* const thread)
+{
+ struct thread* previous = 0;
+
+ if (queue->head != thread)
+  for (previous = queue->head; previous->next != thread;
+       previous = previous->next)
+   ;
+
+ thread_queue_remove(queue, previous, thread);
+}
+
+/*! Moves all threads of a queue into an empty queue. */
+static void
+thread_queue_move(struct thread_queue* const to,
+                  struct thread_queue* const from)
+{
+ *to = *from;
+ from->head = 0;
+ from->tail = 0;
+ from->length = 0;
+}
+
+/*! Returns the queue of the threads waiting on address in address_space. */
+static struct thread_queue*
+wait_queue(const struct address_space* const address_space,
+           const uintptr_t address)
+{
+ const uintptr_t key = (address >> 2) ^ ((uintptr_t) address_space >> 6);
+
+ return &wait_queues[(key ^ (key >> 6)) & (WAIT_QUEUE_BUCKETS - 1)];
+}
+
+/*! Returns the key of the word at address in the current process and sets
+    *space to the address space it is in. Words in shared memory are keyed
+    on their physical address, with *space 0, so threads of all processes
+    sharing them meet. */
+static uintptr_t
+wait_key(const uintptr_t address, const struct address_space** const space)
+{
+ const uintptr_t shared =
+  address_space_shared_address(current_process->address_space, address);
+
+ if (0 != shared)
+ {
+  *space = 0;
+  return shared;
+ }
+
+ *space = current_process->address_space;
+ return address;
+}
+
+/*! Puts a thread last in the ready queue of its cpu and priority. A cpu
+    idling in mwait wakes at once. One idling in hlt finds the thread on its
+    next timer interrupt. */
+static void
+make_ready(struct thread* const thread)
+{
+ thread_queue_enqueue(&ready_queues[thread->cpu][thread->priority], thread);
+
+ if (cpus[thread->cpu].idle)
+  cpus[thread->cpu].idle = 0;
+}
+
+/*! Wakes at most count threads waiting on the word with key key in space,
+    see wait_key, the one that waited longest first. The woken threads go
+    into the ready queues of their cpus. Returns the number woken. */
+static uint32_t
+wake_threads(const struct address_space* const space, const uintptr_t key,
+             const uint32_t count)
+{
+ struct thread_queue* const queue = wait_queue(space, key);
+ struct thread*             previous = 0;
+ struct thread*             thread = queue->head;
+ uint32_t                   woken = 0;
+
+ while ((0 != thread) && (woken < count))
+ {
+  struct thread* const next = thread->next;
+
+  if ((thread->wait_address == key) && (thread->wait_space == space))
+  {
+   thread_queue_remove(queue, previous, thread);
+   thread->state = THREAD_RUNNABLE;
+   make_ready(thread);
+   woken++;
+  }
+  else
+   previous = thread;
+
+  thread = next;
+ }
+
+ return woken;
+}
+
+/*! Releases the control block of a thread and its FPU and SSE state. A cpu
+    holding the registers of the thread forgets them. Threads sending to it
+    or waiting for its reply are woken with ERROR. */
+static void
+free_thread(struct thread* const thread)
+{
+ struct thread** link = &thread_table[thread->id & (THREAD_TABLE_BUCKETS - 1)];
+ struct thread*  other;
+
+ while (*link != thread)
+  link = &(*link)->hash_next;
+ *link = thread->hash_next;
+
+ if (THREAD_SENDING == thread->state)
+  thread_queue_unlink(&thread->partner->senders, thread);
+ else if (THREAD_REPLY_WAIT == thread->state)
+  thread_queue_unlink(&thread->partner->callers, thread);
+ else if (THREAD_CHILD_WAIT == thread->state)
+  thread_queue_unlink(&thread->process->child_waiters, thread);
+
+ if (thread->process->async_owner == thread)
+  thread->process->async_owner = 0;
+
+ while ((0 != (other = thread_queue_dequeue(&thread->senders))) ||
+        (0 != (other = thread_queue_dequeue(&thread->callers))))
+ {
+  other->eax = ERROR;
+  other->state = THREAD_RUNNABLE;
+  make_ready(other);
+ }
+
+ if (0 != thread->fpu_state)
+ {
+  uint32_t cpu;
+
+  for (cpu = 0; cpu < MAX_CPUS; cpu++)
+   if (cpus[cpu].fpu_owner == thread)
+    cpus[cpu].fpu_owner = 0;
+
+  object_cache_free(&fpu_state_cache, thread->fpu_state);
+ }
+
+ object_cache_free(&thread_cache, thread);
+}
+
+/*! Returns the child of process with the given id, or 0 if there is none.
+    If id is 0, a child that has exited is returned if there is one, else
+    any child. */
+static struct process*
+find_child(const struct process* const process, const uint32_t id)
+{
+ struct process* child;
+
+ for (child = process->children; 0 != child; child = child->sibling)
+  if ((id == child->id) || ((0 == id) && child->exited))
+   return child;
+
+ return (0 == id) ? process->children : 0;
+}
+
+/*! Hands the exit status of an exited child to a thread waiting for it,
+    and releases the control block of the child. */
+static void
+reap_child(struct thread* const thread, struct process* const child)
+{
+ struct process** link = &child->parent->children;
+
+ while (*link != child)
+  link = &(*link)->sibling;
+ *link = child->sibling;
+
+ thread->eax = child->id;
+ thread->esi = child->exit_status;
+ object_cache_free(&process_cache, child);
+}
+
+/*! Wakes the first thread of the parent waiting for child, which has just
+    exited, with its exit status. Threads left waiting for children that no
+    longer exist are woken with ERROR. */
+static void
+notify_parent(struct process* const child)
+{
+ struct process* const      parent = child->parent;
+ struct thread_queue* const queue = &parent->child_waiters;
+ struct thread*             previous = 0;
+ struct thread*             thread = queue->head;
+ int                        reaped = 0;
+
+ while (0 != thread)
+ {
+  struct thread* const next = thread->next;
+
+  if ((!reaped && ((0 == thread->wait_address) ||
+                   (child->id == thread->wait_address))) ||
+      (reaped && (0 == find_child(parent, thread->wait_address))))
+  {
+   thread_queue_remove(queue, previous, thread);
+   if (!reaped)
+   {
+    reap_child(thread, child);
+    reaped = 1;
+   }
+   else
+    thread->eax = ERROR;
+   thread->state = THREAD_RUNNABLE;
+   make_ready(thread);
+  }
+  else
+   previous = thread;
+
+  thread = next;
+ }
+}
+
+#ifdef BENCHMARK
+
+/*! Prints the statistics of an object cache that owns slabs. */
+static void
+print_object_cache(const struct object_cache_statistics* const statistics)
+{
+ if (0 == statistics->slabs)
+  return;
+
+ kprints(statistics->name);
+ kprints(" cache, objects: ");
+ kprinthex(statistics->active_objects);
+ kprints("  slabs: ");
+ kprinthex(statistics->slabs);
+ kprints("  bytes: ");
+ kprinthex(statistics->bytes);
+}
+
+#endif
+
+/*! Releases the threads of a process and all memory it allocated. The
+    control block is kept for the parent to wait for, if the parent still
+    exists. Children become orphans, and those that have exited are
+    released. */
+static void
+destroy_process(struct process* const process)
+{
+ struct thread* thread = process->threads;
+
+ while (0 != process->children)
+ {
+  struct process* const child = process->children;
+
+  process->children = child->sibling;
+  if (child->exited)
+   object_cache_free(&process_cache, child);
+  else
+   child->parent = 0;
+ }
+
+ if (0 != process->async_rings)
+ {
+  struct process**     link = &async_processes;
+  struct async_timer** timer = &async_timers;
+
+  while (*link != process)
+   link = &(*link)->async_next;
+  *link = process->async_next;
+
+  while (0 != *timer)
+   if ((*timer)->process == process)
+   {
+    struct async_timer* const expired = *timer;
+
+    *timer = expired->next;
+    object_cache_free(&async_timer_cache, expired);
+   }
+   else
+    timer = &(*timer)->next;
+ }
+
+ address_space_destroy(process->address_space);
+
+ while (0 != thread)
+ {
+  struct thread* const sibling = thread->sibling;
+
+  free_thread(thread);
+  thread = sibling;
+ }
+
+ process->threads = 0;
+ process->address_space = 0;
+ process->exited = 1;
+
+ if (0 != process->parent)
+  notify_parent(process);
+ else
+  object_cache_free(&process_cache, process);
+
+#ifdef BENCHMARK
+ /* Objects left in the caches once a process is gone show leaks. */
+ object_cache_report(print_object_cache);
+#endif
+}
+
+/*! Returns the highest priority with a ready thread on the calling cpu, or
+    PRIORITY_LEVELS if no thread is ready there. */
+static uint32_t
+highest_ready_priority(void)
+{
+ struct thread_queue* const queues = ready_queues[this_cpu()->id];
+ uint32_t                   priority;
+
+ for (priority = 0; priority < PRIORITY_LEVELS; priority++)
+  if (0 != queues[priority].head)
+   break;
+
+ return priority;
+}
+
+/*! Takes the ready thread of the highest priority from the cpu with the
+    most ready threads and moves it to the calling cpu. The thread whose FPU
+    and SSE registers are loaded on that cpu is left there, as they can only
+    be saved by that cpu. Returns 0 if no other cpu has a thread to give. */
+static struct thread*
+steal_thread(void)
+{
+ const uint32_t id     = this_cpu()->id;
+ uint32_t       victim = id;
+ uint32_t       most   = 0;
+ uint32_t       cpu;
+ uint32_t       priority;
+
+ for (cpu = 0; cpu < MAX_CPUS; cpu++)
+ {
+  uint32_t ready = 0;
+
+  for (priority = 0; priority < PRIORITY_LEVELS; priority++)
+   ready += ready_queues[cpu][priority].length;
+
+  if ((cpu != id) && (ready > most))
+  {
+   most = ready;
+   victim = cpu;
+  }
+ }
+
+ if (0 == most)
+  return 0;
+
+ for (priority = 0; priority < PRIORITY_LEVELS; priority++)
+ {
+  struct thread_queue* const queue = &ready_queues[victim][priority];
+  struct thread*             previous = 0;
+  struct thread*             thread;
+
+  for (thread = queue->head; 0 != thread; thread = thread->next)
+  {
+   if (thread != cpus[victim].fpu_owner)
+   {
+    thread_queue_remove(queue, previous, thread);
+    thread->cpu = id;
+    return thread;
+   }
+   previous = thread;
+  }
+ }
+
+ return 0;
+}
+
+/*! Moves the threads running on all cpus and all ready threads back to
+    their base priority. */
+static void
+boost_priorities(void)
+{
+ uint32_t cpu;
+ uint32_t priority;
+
+ /* The other cpus only change their thread with the kernel lock held. */
+ for (cpu = 0; cpu < cpu_count; cpu++)
+  if (0 != cpus[cpu].thread)
+   cpus[cpu].thread->priority = cpus[cpu].thread->base_priority;
+
+ for (cpu = 0; cpu < MAX_CPUS; cpu++)
+  for (priority = 1; priority < PRIORITY_LEVELS; priority++)
+  {
+   struct thread_queue queue;
+   struct thread*      thread;
+
+   thread_queue_move(&queue, &ready_queues[cpu][priority]);
+
+   while (0 != (thread = thread_queue_dequeue(&queue)))
+   {
+    thread->priority = thread->base_priority;
+    make_ready(thread);
+   }
+  }
+
+ last_priority_boost = timer_ticks;
+}
+
+/*! Points an entry of the interrupt descriptor table to handler through an
+    interrupt gate running in the kernel code segment. Interrupts are
+    disabled while the handler runs. */
+static void
+set_interrupt_gate(const int vector, const uint8_t* const handler)
+{
+ const uintptr_t address = (uintptr_t) handler;
+
+ idt[2 * vector] = (8 << 16) | (address & 0xffff);
+ idt[2 * vector + 1] = (address & 0xffff0000) | 0x8e00;
+}
+
+/*! Makes the next FPU or SSE instruction fault unless the registers of
+    thread are loaded on the calling cpu. The fault loads them. Threads that
+    do not use the FPU never take the fault. */
+static void
+fpu_prepare(const struct thread* const thread)
+{
+ const uint32_t cr0 = read_cr0();
+
+ if (thread == this_cpu()->fpu_owner)
+ {
+  if (cr0 & CR0_TS)
+   clts();
+ }
+ else if (!(cr0 & CR0_TS))
+  write_cr0(cr0 | CR0_TS);
+}
+
+/*! Lets the calling cpu run FPU and SSE instructions in user space. The
+    first one a thread runs faults, see fpu_prepare. */
+static void
+fpu_init_cpu(void)
+{
+ uint32_t eax, ebx, ecx, edx;
+
+ cpuid(1, &eax, &ebx, &ecx, &edx);
+
+ if (!(edx & CPUID_FXSR))
+ {
+  write_cr0(read_cr0() | CR0_EM | CR0_TS);
+  return;
+ }
+
+ write_cr0((read_cr0() & ~CR0_EM) | CR0_MP | CR0_TS);
+ if (edx & CPUID_SSE)
+  write_cr4(read_cr4() | CR4_OSFXSR | CR4_OSXMMEXCPT);
+ fpu_available = 1;
+}
+
+/*! Waits for an interrupt, or with mwait for a thread to be made ready on
+    the calling cpu, without the kernel lock. mwait lets the processor sleep
+    deeper than hlt, and under a hypervisor both give the host cpu back. */
+static void
+idle(void)
+{
+ struct cpu* const cpu = this_cpu();
+
+ cpu->idle = 1;
+ kernel_lock_release();
+
+ if (mwait_available)
+ {
+  /* A thread made ready after the flag was set clears it before or after
+     the line is armed. Either way the cpu does not sleep past it. */
+  monitor(&cpu->idle);
+  if (cpu->idle)
+   sti_mwait();
+ }
+ else
+ {
+  sti();
+  hlt();
+ }
+ cli();
+
+ cpu->idle = 0;
+ kernel_lock_acquire();
+}
+
+/*! Makes thread the current thread of the calling cpu. */
+static void
+switch_to(struct thread* const thread)
+{
+ thread->cpu = this_cpu()->id;
+ current_thread = thread;
+ current_process = thread->process;
+ address_space_switch(current_process->address_space);
+ fpu_prepare(thread);
+}
+
+/*! Makes the first thread of the highest priority ready queue of the
+    calling cpu the current thread. If there is none, a thread is taken
+    from another cpu. The cpu waits until there is a thread to take. */
+static void
+schedule(void)
+{
+ const uint32_t id = this_cpu()->id;
+ struct thread* thread;
+ uint32_t       priority;
+
+ for (;;)
+ {
+  priority = highest_ready_priority();
+  if (priority < PRIORITY_LEVELS)
+  {
+   thread = thread_queue_dequeue(&ready_queues[id][priority]);
+   break;
+  }
+
+  thread = steal_thread();
+  if (0 != thread)
+  {
+   priority = thread->priority;
+   break;
+  }
+
+  /* Nothing to run. Idle in the kernel page tables, as the address space
+     of the last thread may be torn down meanwhile. */
+  current_thread = 0;
+  current_process = 0;
+  address_space_switch(0);
+
+  /* The timer interrupt only expires timeouts when it interrupts a thread,
+     so a cpu idling in the kernel checks them on each wakeup. Their waiters
+     may have been made ready. */
+  if (0 != async_timers)
+  {
+   struct async_timer* const first = async_timers;
+
+   async_expire_timers();
+   if (first != async_timers)
+    continue;
+  }
+
+  if (!async_poll())
+   idle();
+ }
+
+ switch_to(thread);
+ time_slice_left[id] = TIME_SLICE << priority;
+}
+
+/*! Runs thread, which was just unblocked, on the calling cpu in place of
+    the current thread, which has blocked. It gets the rest of the time
+    slice. The thread goes through the ready queue of its cpu instead if its
+    FPU registers are loaded there. */
+static void
+hand_off(struct thread* const thread)
+{
+ if ((thread->cpu != this_cpu()->id) &&
+     (cpus[thread->cpu].fpu_owner == thread))
+ {
+  make_ready(thread);
+  schedule();
+ }
+ else
+  switch_to(thread);
+}
+
+/*! Moves the message in esi and ebx of sender to receiver, together with
+    the id of the sender in eax. The sender then waits for the reply of
+    the receiver. */
+static void
+deliver_message(struct thread* const sender, struct thread* const receiver)
+{
+ receiver->eax = sender->id;
+ receiver->esi = sender->esi;
+ receiver->ebx = sender->ebx;
+ receiver->state = THREAD_RUNNABLE;
+
+ sender->state = THREAD_REPLY_WAIT;
+ sender->partner = receiver;
+ thread_queue_enqueue(&receiver->callers, sender);
+}
+
+/*! Gives the reply first, second to the thread with id caller, which must
+    wait for the reply of replier. Returns the thread, which the caller
+    must make run, or 0 if it does not wait for a reply. */
+static struct thread*
+deliver_reply(struct thread* const replier, const uint32_t caller,
+              const uint32_t first, const uint32_t second)
+{
+ struct thread* const thread = find_thread(caller);
+
+ if ((0 == replier) || (0 == thread) ||
+     (THREAD_REPLY_WAIT != thread->state) || (thread->partner != replier))
+  return 0;
+
+ thread_queue_unlink(&replier->callers, thread);
+ thread->eax = ALL_OK;
+ thread->esi = first;
+ thread->ebx = second;
+ thread->state = THREAD_RUNNABLE;
+ return thread;
+}
+
+/*! Removes a thread from the list of threads of its process. */
+static void
+unlink_thread(struct thread* const thread)
+{
+ struct thread** link = &thread->process->threads;
+
+ while (*link != thread)
+  link = &(*link)->sibling;
+ *link = thread->sibling;
+}
+
+/*! Terminates the current thread and runs the next ready thread. The
+    process is terminated with its last thread. The thread is freed before
+    the next one is picked, so the threads it wakes, such as a parent
+    waiting for the process, can be picked even if nothing else is ready. */
+static void
+terminate_thread(void)
+{
+ struct thread* const  thread = current_thread;
+ struct process* const process = current_process;
+
+ current_thread = 0;
+
+ if ((thread == process->threads) && (0 == thread->sibling))
+ {
+  /* Leave the address space before it is torn down. */
+  current_process = 0;
+  address_space_switch(0);
+  destroy_process(process);
+  schedule();
+  return;
+ }
+
+ unlink_thread(thread);
+
+ /* The frames of a large stack are released with it. */
+ if (0 != thread->stack)
+  arena_free(process->address_space, thread->stack);
+
+ free_thread(thread);
+ schedule();
+}
+
+/*! Frees the threads of process found in queue. The other threads stay in
+    the queue in the same order. */
+static void
+free_queued_threads(struct thread_queue* const queue,
+                    struct process* const process)
+{
+ struct thread_queue threads;
+ struct thread*      thread;
+
+ thread_queue_move(&threads, queue);
+
+ while (0 != (thread = thread_queue_dequeue(&threads)))
+  if (thread->process != process)
+   thread_queue_enqueue(queue, thread);
+  else
+  {
+   unlink_thread(thread);
+   free_thread(thread);
+  }
+}
+
+/*! Terminates the current process with all its threads and runs the next
+    ready thread. Threads of the process running on other cpus terminate
+    when they next enter the kernel, and the last one to do so tears the
+    process down. */
+static void
+terminate_process(void)
+{
+ struct process* const process = current_process;
+ struct thread**       link = &process->threads;
+ uint32_t              cpu;
+ uint32_t              priority;
+ uint32_t              bucket;
+
+ process->terminating = 1;
+ process->exit_status = EXIT_STATUS_KILLED;
+
+ /* Threads blocked in IPC or waiting for a child are in no queue swept
+    below. Freeing them may wake other threads of the process, which the
+    sweep then frees. */
+ while (0 != *link)
+ {
+  struct thread* const thread = *link;
+
+  if ((THREAD_SENDING == thread->state) ||
+      (THREAD_RECEIVING == thread->state) ||
+      (THREAD_REPLY_WAIT == thread->state) ||
+      (THREAD_CHILD_WAIT == thread->state))
+  {
+   *link = thread->sibling;
+   free_thread(thread);
+  }
+  else
+   link = &thread->sibling;
+ }
+
+ for (cpu = 0; cpu < MAX_CPUS; cpu++)
+  for (priority = 0; priority < PRIORITY_LEVELS; priority++)
+   free_queued_threads(&ready_queues[cpu][priority], process);
+
+ for (bucket = 0; bucket < WAIT_QUEUE_BUCKETS; bucket++)
+  free_queued_threads(&wait_queues[bucket], process);
+
+ terminate_thread();
+}
+
+/*! Charges a timer interrupt to the current thread and goes back to user
+    space. A thread that uses up its time slice moves one level down and
+    the next ready thread runs. A thread is also stopped early when a
+    thread of higher priority is ready, which can happen after a boost. */
+static void
+tick(void)
+{
+ const uint32_t id = this_cpu()->id;
+
+ if (current_process->terminating)
+  terminate_thread();
+ else if (0 == --time_slice_left[id])
+ {
+  if (current_thread->priority < PRIORITY_LEVELS - 1)
+   current_thread->priority++;
+  make_ready(current_thread);
+  schedule();
+ }
+ else if (highest_ready_priority() < current_thread->priority)
+ {
+  make_ready(current_thread);
+  schedule();
+ }
+
+ go_to_user_space();
+}
+
+/*! Number of characters print_string copies to the kernel stack at a
+    time. */
+#define PRINT_CHUNK (64)
+
+/*! Prints the string at address in the current process, at most
+    MAX_PRINT_LENGTH characters of it. The characters are copied out before
+    they are printed, so another thread changing the string can not make
+    the kernel read past the pages checked. Returns ALL_OK, or ERROR if the
+    string runs into memory the process can not read. */
+static int32_t
+print_string(uintptr_t address)
+{
+ char     chunk[PRINT_CHUNK + 1];
+ uint32_t printed = 0;
+
+ while (printed < MAX_PRINT_LENGTH)
+ {
+  uint32_t length = 0;
+
+  while ((length < PRINT_CHUNK) && (printed + length < MAX_PRINT_LENGTH))
+  {
+   if (((0 == length) || (0 == (address & (PAGE_SIZE - 1)))) &&
+       !address_space_is_readable(current_process->address_space, address,
+                                  1))
+   {
+    chunk[length] = 0;
+    kprints(chunk);
+    return ERROR;
+   }
+
+   chunk[length] = *(const volatile char*) address;
+   if (0 == chunk[length])
+   {
+    kprints(chunk);
+    return ALL_OK;
+   }
+
+   length++;
+   address++;
+  }
+
+  chunk[length] = 0;
+  kprints(chunk);
+  printed += length;
+ }
+
+ return ALL_OK;
+}
+
+/*! Returns the histogram bucket for a call that took cycles cycles. */
+static int
+latency_bucket(const uint32_t cycles)
+{
+ return 31 - __builtin_clz(cycles | 1);
+}
+
+/*! Records an allocation that started at start cycles and returned block.
+    Returns the address of the block, or ERROR if block is 0. */
+static int32_t
+count_allocation(const uint32_t start, void* const block)
+{
+ memory_statistics.allocation_cycles[latency_bucket((uint32_t) rdtsc() -
+                                                    start)]++;
+
+ if (0 == block)
+ {
+  memory_statistics.allocation_failures++;
+  return ERROR;
+ }
+
+ memory_statistics.allocations++;
+ return (int32_t) block;
+}
+
+/*! Allocates length bytes for the current process at a multiple of
+    alignment, or at the default alignment if it is 0. The block is cleared
+    if zeroed is set. Returns the address of the block or ERROR when no
+    block of that size is available. */
+static int32_t
+allocate_memory(const uint32_t length, const uint32_t alignment,
+                const int zeroed)
+{
+ const uint32_t start = (uint32_t) rdtsc();
+
+ return count_allocation(start,
+                         arena_allocate(current_process->address_space,
+                                        length, alignment, zeroed));
+}
+
+/*! Resizes a block allocated by the current process. Returns the new
+    address of the block, or ERROR if address does not refer to a block
+    handed out to the process or memory is exhausted. */
+static int32_t
+resize_memory(const uint32_t address, const uint32_t length)
+{
+ const uint32_t start = (uint32_t) rdtsc();
+
+ return count_allocation(start,
+                         arena_resize(current_process->address_space,
+                                      (void*) address, length));
+}
+
+/*! Frees a block allocated by the current process. Returns ALL_OK, or ERROR
+    if address does not refer to a block handed out to the process. */
+static int32_t
+free_memory(const uint32_t address)
+{
+ const uint32_t start = (uint32_t) rdtsc();
+ const int      freed = arena_free(current_process->address_space,
+                                   (void*) address);
+
+ memory_statistics.free_cycles[latency_bucket((uint32_t) rdtsc() - start)]++;
+
+ if (!freed)
+ {
+  memory_statistics.free_failures++;
+  return ERROR;
+ }
+
+ memory_statistics.frees++;
+ return ALL_OK;
+}
+
+/*! Copies the allocation counters and the state of the heap of the current
+    process into statistics. */
+static void
+report_memory(struct memory_statistics* const statistics)
+{
+ struct heap_statistics heap;
+ int                    i;
+
+ *statistics = memory_statistics;
+
+ extent_heap_report(&current_process->address_space->arena, &heap);
+
+ statistics->used_bytes = heap.used_bytes;
+ statistics->free_bytes = 0;
+ for (i = 0; i < MEMORY_SIZE_CLASSES; i++)
+ {
+  statistics->free_bytes_per_class[i] = heap.free_bytes[i];
+  statistics->free_bytes += heap.free_bytes[i];
+ }
+ statistics->largest_free_block = heap.largest_free_block;
+
+ /* Scale the free bytes down rather than the largest block up, as the
+    product would not fit in 32 bits. */
+ statistics->fragmentation = 0;
+ if (statistics->free_bytes >= 1000)
+ {
+  const uint32_t share = statistics->largest_free_block /
+                         (statistics->free_bytes / 1000);
+
+  statistics->fragmentation = (share < 1000) ? 1000 - share : 0;
+ }
+}
+
+/*! Returns where the byte at offset in the rings of process lies in the
+    kernel mappings. The rings are in shared memory, whose frames are
+    identity mapped, so this works whichever address space is loaded. An
+    entry never straddles two pages. */
+static void*
+async_address(const struct process* const process, const uint32_t offset)
+{
+ return (void*) address_space_shared_address(process->address_space,
+                                             process->async_rings + offset);
+}
+
+/*! Queues a completion in the rings of process. Returns zero if the
+    completion ring is full. */
+static int
+async_complete(const struct process* const process,
+               struct async_rings* const rings, const uint32_t user_data,
+               const int32_t result)
+{
+ const uint32_t                    entries = 2 * process->async_entries;
+ const uint32_t                    tail = rings->completion_tail;
+ volatile struct async_completion* completion;
+
+ /* A head the process has moved past the tail counts as a full ring. */
+ if (tail - rings->completion_head >= entries)
+  return 0;
+
+ completion = async_address(process,
+                            ASYNC_COMPLETIONS(process->async_entries) +
+                            (tail & (entries - 1)) *
+                            sizeof(struct async_completion));
+ completion->user_data = user_data;
+ completion->result = result;
+ rings->completion_tail = tail + 1;
+ return 1;
+}
+
+/*! Wakes the threads of process waiting for completions. */
+static void
+async_notify(struct async_rings* const rings)
+{
+ /* The rings are shared memory, so the word is keyed on its physical
+    address, which is also its address in the kernel mappings. */
+ wake_threads(0, (uintptr_t) &rings->completion_tail, UINT32_MAX);
+}
+
+/*! Queues a timeout of process that completes with user_data after
+    milliseconds milliseconds. Returns zero if memory is exhausted. */
+static int
+async_add_timer(struct process* const process, const uint32_t milliseconds,
+                const uint32_t user_data)
+{
+ struct async_timer* const timer = object_cache_allocate(&async_timer_cache);
+ struct async_timer**      link = &async_timers;
+
+ if (0 == timer)
+  return 0;
+
+ /* Round up, so the timeout never completes early. */
+ timer->deadline = timer_ticks + 1 +
+                   milliseconds / 1000 * TIMER_FREQUENCY +
+                   (milliseconds % 1000) * TIMER_FREQUENCY / 1000;
+ timer->process = process;
+ timer->user_data = user_data;
+
+ while ((0 != *link) && ((int32_t) ((*link)->deadline - timer->deadline) <= 0))
+  link = &(*link)->next;
+ timer->next = *link;
+ *link = timer;
+ return 1;
+}
+
+/*! Queues the completions of the timeouts that have expired. A timeout
+    whose completion ring is full stays queued, and so do the ones behind
+    it, until the next timer interrupt. */
+static void
+async_expire_timers(void)
+{
+ while ((0 != async_timers) &&
+        ((int32_t) (timer_ticks - async_timers->deadline) >= 0))
+ {
+  struct async_timer* const timer = async_timers;
+  struct async_rings* const rings = async_address(timer->process, 0);
+
+  if (!async_complete(timer->process, rings, timer->user_data, ALL_OK))
+   return;
+
+  async_notify(rings);
+  async_timers = timer->next;
+  object_cache_free(&async_timer_cache, timer);
+ }
+}
+
+/*! Carries out one operation queued by process, which must be the current
+    process. Sets *complete to zero if the completion is queued later.
+    Returns the result of the operation. */
+static int32_t
+async_perform(struct process* const process,
+              const volatile struct async_submission* const submission,
+              int* const complete)
+{
+ const uint32_t first = submission->arguments[0];
+ const uint32_t second = submission->arguments[1];
+
+ switch (submission->operation)
+ {
+  case SYSCALL_PRINTS:
+   return print_string(first);
+
+  case SYSCALL_ALLOCATE:
+   return allocate_memory(first, 0, 0);
+
+  case SYSCALL_ALLOCATE_ALIGNED:
+   return allocate_memory(first, second, 0);
+
+  case SYSCALL_ALLOCATE_ZEROED:
+   return allocate_memory(first, 0, 1);
+
+  case SYSCALL_RESIZE:
+   return resize_memory(first, second);
+
+  case SYSCALL_FREE:
+   return free_memory(first);
+
+  case SYSCALL_WAKE:
+  {
+   const struct address_space* space;
+   const uintptr_t             key = wait_key(first, &space);
+
+   return wake_threads(space, key, second);
+  }
+
+  case SYSCALL_REPLY:
+  {
+   struct thread* const caller =
+    deliver_reply(process->async_owner, first, second,
+                  submission->arguments[2]);
+
+   if (0 == caller)
+    return ERROR;
+
+   make_ready(caller);
+   return ALL_OK;
+  }
+
+  case ASYNC_TIMEOUT:
+   if (!async_add_timer(process, first, submission->user_data))
+    return ERROR;
+   *complete = 0;
+   return ALL_OK;
+
+  default:
+   return ERROR_ILLEGAL_SYSCALL;
+ }
+}
+
+/*! Carries out the operations queued in the submission ring of process,
+    which must be the current process. Stops when the ring is empty, the
+    completion ring is full or as many operations as the ring holds are
+    done, so a process queueing all the time can not keep the kernel.
+    Returns the number of operations taken from the ring. */
+static uint32_t
+async_drain(struct process* const process)
+{
+ struct async_rings* const rings = async_address(process, 0);
+ const uint32_t            entries = process->async_entries;
+ const uint32_t            tail = rings->submission_tail;
+ uint32_t                  head = rings->submission_head;
+ uint32_t                  done = 0;
+
+ if (tail - head > entries)
+  return 0;
+
+ while ((head != tail) &&
+        (rings->completion_tail - rings->completion_head <
+         2 * entries))
+ {
+  const volatile struct async_submission* const submission =
+   async_address(process, ASYNC_SUBMISSIONS + (head & (entries - 1)) *
+                          sizeof(struct async_submission));
+  int           complete = 1;
+  const int32_t result = async_perform(process, submission, &complete);
+
+  if (complete)
+   async_complete(process, rings, submission->user_data, result);
+
+  rings->submission_head = ++head;
+  done++;
+ }
+
+ if (0 != done)
+  async_notify(rings);
+
+ return done;
+}
+
+/*! Drains the submission rings of the processes with queued operations.
+    Each ring is drained in the address space of its process, and the
+    calling cpu is left in the kernel page tables, so none of them is kept
+    loaded while the cpu idles. Returns nonzero if an operation was done. */
+static int
+async_poll(void)
+{
+ struct process* process;
+ int             drained = 0;
+
+ for (process = async_processes; 0 != process; process = process->async_next)
+ {
+  const struct async_rings* const rings = async_address(process, 0);
+
+  if (process->terminating ||
+      (rings->submission_head == rings->submission_tail))
+   continue;
+
+  /* The operations run as if the process had entered the kernel, so
+     faults on its heap are resolved in its address space. */
+  current_process = process;
+  address_space_switch(process->address_space);
+  if (0 != async_drain(process))
+   drained = 1;
+ }
+
+ current_process = 0;
+ address_space_switch(0);
+ return drained;
+}
+
+/* Definitions. */
+
+void kernel_init(register uint32_t* const multiboot_information
+                                          /*!< Points to a multiboot
+                                               information structure. */)
+{
+ /* The Multiboot specification dictates that a boot loader will leave
+    information in memory for the kernel to use, see
+    http://www.gnu.org/software/grub/manual/multiboot . We go through the
+    information and extract the information we need. We also sanity check. */
+
+ /* Check if the boot loader left information on memory. */
+ if (!(0x41 & *multiboot_information))
+  halt_the_machine();
+
+ /* Extract information on which memory is available in the machine. This
+    has to be done before any memory is handed out as the boot loader may
+    have placed the information in memory that is reported as usable. */
+ find_memory_regions(multiboot_information);
+ {
+  int i;
+
+  top_of_available_physical_memory = 0;
+  for (i = 0; i < memory_region_count; i++)
+   if (memory_regions[i].end > top_of_available_physical_memory)
+    top_of_available_physical_memory = memory_regions[i].end;
+ }
+
+ /* The memory system keeps its own data right after the kernel image and
+    the embedded applications. */
+ lowest_available_physical_memory =
+  ((uintptr_t) end_of_bss > (uintptr_t) end_of_applications) ?
+  (uintptr_t) end_of_bss : (uintptr_t) end_of_applications;
+
+ /* Initialize the memory system. */
+ initialize();
+ add_available_memory();
+
+ /* Set up the caches holding the control blocks. */
+ object_cache_init(&thread_cache, "thread", sizeof(struct thread));
+ object_cache_init(&process_cache, "process", sizeof(struct process));
+ object_cache_init(&fpu_state_cache, "fpu state", FPU_STATE_SIZE);
+ object_cache_init(&async_timer_cache, "async timer",
+                   sizeof(struct async_timer));
+
+ /* Keep a copy of the initial data of each application. This has to be
+    done before paging is turned on as the applications are not mapped in
+    the kernel address space. */
+ {
+  int i;
+
+  for (i = 0; i < EXECUTABLE_TABLE_SIZE; i++)
+  {
+   const uint32_t* const data =
+    (const uint32_t*) (executable_table[i] + EXECUTABLE_TEXT_SIZE);
+   uint32_t*             copy;
+   int                   j;
+
+   executable_data[i] = frame_allocate(EXECUTABLE_DATA_ORDER);
+   if (0 == executable_data[i])
+    halt_the_machine();
+
+   copy = executable_data[i];
+   for (j = 0;
+        j < (EXECUTABLE_SLOT_SIZE - EXECUTABLE_TEXT_SIZE) / sizeof(uint32_t);
+        j++)
+    copy[j] = data[j];
+  }
+ }
+
+ /* Turn on paging. */
+ paging_init();
+
+ /* Check if we can use sysenter/sysret. It is highly likely that sysenter
+    is supported, it has been since Pentium 2, so this is really a sanity
+    check. */
+ {
+  uint32_t eax, ebx, ecx, edx;
+
+  cpuid(1, &eax, &ebx, &ecx, &edx);
+
+  /* Check if the processor says it supports sysenter. */
+  if (!(0x800 & edx))
+   halt_the_machine();
+
+  mwait_available = (0 != (ecx & CPUID_MONITOR));
+
+  /* Pentium Pro has a bug in that it errouneously says it supports
+     sysenter. Check if we are running on processor such as Pentium
+     Pro which does not support sysenter. */
+  if ((((eax & 0x00000F00) >> 8) == 6) &&
+     (((eax & 0x000000F0) >> 4) < 3) &&
+     ((eax & 0x0000000F) < 3))
+   halt_the_machine();
+ }
+
+ /* Give the boot cpu its descriptor tables, per-cpu segment and kernel
+    stack. */
+ smp_cpu_init(0, (uintptr_t) kernel_stack);
+ fpu_init_cpu();
+
+ /* Set up the interrupt descriptor table. Page faults and the timer are
+    handled, as are FPU and SSE instructions faulting to have the state of
+    the thread loaded. Spurious interrupts from the interrupt controller are
+    ignored. */
+ set_interrupt_gate(DEVICE_NOT_AVAILABLE_VECTOR,
+                    device_not_available_entry_point);
+ set_interrupt_gate(PAGE_FAULT_VECTOR, page_fault_entry_point);
+ set_interrupt_gate(TIMER_VECTOR, timer_entry_point);
+ set_interrupt_gate(SPURIOUS_VECTOR, spurious_interrupt_entry_point);
+ set_interrupt_gate(APIC_TIMER_VECTOR, apic_timer_entry_point);
+ set_interrupt_gate(TLB_FLUSH_VECTOR, tlb_flush_entry_point);
+ set_interrupt_gate(APIC_SPURIOUS_VECTOR, spurious_interrupt_entry_point);
+ lidt(sizeof(idt) - 1, (uintptr_t) idt);
+
+ /* Start the timer. Its interrupts are taken once user space runs. */
+ timer_init(TIMER_FREQUENCY);
+
+ /* Start the other cpus. They wait for the kernel lock, which this cpu
+    holds until it goes to user space. */
+ smp_init();
+
+ /* clear the screen (Nicklas' edit) */
+ cls();
+ kprints("The kernel has booted!\n");
+ kprints("Cpus: ");
+ kprinthex(cpu_count);
+
+#ifdef BENCHMARK
+ paging_benchmark();
+ timer_benchmark(TIMER_FREQUENCY);
+#endif
+
+ /* Set up the first process. */
+ {
+  struct process* const process = create_process(0);
+
+  if (0 == process)
+   halt_the_machine();
+  make_ready(process->threads);
+  schedule();
+ }
+
+ /* Go to user space. */
+ go_to_user_space();
+}
+
+void handle_system_call(void)
+{
+ kernel_lock_acquire();
+
+ if (current_process->terminating)
+ {
+  terminate_thread();
+  go_to_user_space();
+ }
+
+ switch (current_thread->eax)
+ {
+  case SYSCALL_VERSION:
+  {
+   current_thread->eax = 0x00010000;
+   break;
+  }
+
+  case SYSCALL_PRINTS:
+  {
+   /* The address of the string is passed in edi. */
+   current_thread->eax = print_string(current_thread->edi);
+   break;
+  }
+
+  case SYSCALL_CREATEPROCESS:
+  {
+   /* The index of the executable is passed in edi. The new process and
+      then the caller are put last in the ready queue, and the thread at
+      its head runs. */
+   struct process* process;
+
+   if (current_thread->edi >= EXECUTABLE_TABLE_SIZE)
+   {
+    current_thread->eax = ERROR;
+    break;
+   }
+
+   process = create_process(current_thread->edi);
+   if (0 == process)
+   {
+    current_thread->eax = ERROR;
+    break;
+   }
+
+   current_thread->eax = process->id;
+
+   make_ready(process->threads);
+   make_ready(current_thread);
+   schedule();
+   break;
+  }
+
+  case SYSCALL_FORK:
+  {
+   /* The copy and the caller are queued as for
+      SYSCALL_CREATEPROCESS. */
+   struct process* const process = fork_process();
+
+   if (0 == process)
+   {
+    current_thread->eax = ERROR;
+    break;
+   }
+
+   current_thread->eax = process->id;
+   process->threads->eax = 0;
+
+   make_ready(process->threads);
+   make_ready(current_thread);
+   schedule();
+   break;
+  }
+
+  case SYSCALL_TERMINATE:
+  {
+   /* Terminates the current thread, and the process if it was the last
+      thread. The exit status is passed in edi. The next ready thread
+      runs. */
+   current_process->exit_status = current_thread->edi;
+   terminate_thread();
+   break;
+  }
+
+  case SYSCALL_WAIT_CHILD:
+  {
+   /* The id of the child is passed in edi, or 0 for any child. The id of
+      the child is returned with its exit status in esi. */
+   struct process* const child = find_child(current_process,
+                                            current_thread->edi);
+
+   if (0 == child)
+   {
+    current_thread->eax = ERROR;
+    break;
+   }
+
+   if (child->exited)
+   {
+    reap_child(current_thread, child);
+    break;
+   }
+
+   current_thread->state = THREAD_CHILD_WAIT;
+   current_thread->wait_address = current_thread->edi;
+   thread_queue_enqueue(&current_process->child_waiters, current_thread);
+   schedule();
+   break;
+  }
+
+  case SYSCALL_CREATE_THREAD:
+  {
+   /* The entry point is passed in edi and the size of the stack in esi, 0
+      meaning DEFAULT_THREAD_STACK_SIZE. The new thread is put last in the
+      ready queue and the caller continues. */
+   const uint32_t stack_size =
+    (0 != current_thread->esi) ? current_thread->esi :
+                                 DEFAULT_THREAD_STACK_SIZE;
+   struct thread* thread;
+
+   if ((stack_size < MIN_THREAD_STACK_SIZE) ||
+       (stack_size > MAX_THREAD_STACK_SIZE))
+   {
+    current_thread->eax = ERROR;
+    break;
+   }
+
+   thread = create_thread(current_thread->edi, stack_size);
+   if (0 == thread)
+   {
+    current_thread->eax = ERROR;
+    break;
+   }
+
+   current_thread->eax = thread->id;
+   make_ready(thread);
+   break;
+  }
+
+  case SYSCALL_YIELD:
+  {
+   /* Let the other ready threads run before the caller continues. A
+      thread giving up the cpu before its time slice is used up moves one
+      level up, towards its base priority. */
+   current_thread->eax = ALL_OK;
+   if (current_thread->priority > current_thread->base_priority)
+    current_thread->priority--;
+   make_ready(current_thread);
+   schedule();
+   break;
+  }
+
+  case SYSCALL_SET_PRIORITY:
+  {
+   /* The priority is passed in edi. The thread starts over at the new
+      level. */
+   if (current_thread->edi >= PRIORITY_LEVELS)
+   {
+    current_thread->eax = ERROR;
+    break;
+   }
+
+   current_thread->base_priority = current_thread->edi;
+   current_thread->priority = current_thread->edi;
+   current_thread->eax = ALL_OK;
+
+   /* Let a thread of higher priority run if the caller lowered itself
+      below it. */
+   if (highest_ready_priority() < current_thread->priority)
+   {
+    make_ready(current_thread);
+    schedule();
+   }
+   break;
+  }
+
+  case SYSCALL_WAIT:
+  {
+   /* The address is passed in edi and the expected value in esi. The
+      value is compared with the kernel lock held, and SYSCALL_WAKE takes
+      it too, so a wake that follows a change of the word can not be lost.
+      Blocking before the time slice is used up moves the thread one level
+      up, as for SYSCALL_YIELD. */
+   const uintptr_t address = current_thread->edi;
+
+   if ((0 != (address & (sizeof(uint32_t) - 1))) ||
+       !address_space_is_writable(current_process->address_space, address,
+                                  sizeof(uint32_t)))
+   {
+    current_thread->eax = ERROR;
+    break;
+   }
+
+   if (*(volatile uint32_t*) address != current_thread->esi)
+   {
+    current_thread->eax = ERROR_WOULD_BLOCK;
+    break;
+   }
+
+   current_thread->eax = ALL_OK;
+   current_thread->state = THREAD_WAITING;
+   current_thread->wait_address = wait_key(address,
+                                           &current_thread->wait_space);
+   if (current_thread->priority > current_thread->base_priority)
+    current_thread->priority--;
+   thread_queue_enqueue(wait_queue(current_thread->wait_space,
+                                   current_thread->wait_address),
+                        current_thread);
+   schedule();
+   break;
+  }
+
+  case SYSCALL_WAKE:
+  {
+   /* The address is passed in edi and the number of threads to wake in
+      esi. */
+   const struct address_space* space;
+   const uintptr_t             key = wait_key(current_thread->edi, &space);
+
+   current_thread->eax = wake_threads(space, key, current_thread->esi);
+   break;
+  }
+
+  case SYSCALL_SEND:
+  {
+   /* The receiving thread is passed in edi and the message in esi and
+      ebx. The reply comes back in the same registers. A receiver waiting
+      for a message runs at once, on this cpu, without passing through the
+      ready queue. */
+   struct thread* const receiver = find_thread(current_thread->edi);
+
+   if ((0 == receiver) || (receiver == current_thread))
+   {
+    current_thread->eax = ERROR;
+    break;
+   }
+
+   if (THREAD_RECEIVING == receiver->state)
+   {
+    deliver_message(current_thread, receiver);
+    hand_off(receiver);
+    break;
+   }
+
+   current_thread->state = THREAD_SENDING;
+   current_thread->partner = receiver;
+   thread_queue_enqueue(&receiver->senders, current_thread);
+   schedule();
+   break;
+  }
+
+  case SYSCALL_RECEIVE:
+  {
+   /* A thread to reply to before waiting may be passed in edi, or 0, with
+      the reply in esi and ebx. The id of the sender is returned and the
+      message is found in esi and ebx. A thread that replies and then has
+      to wait hands the cpu straight to the thread it replied to, so a
+      round trip passes through no ready queue. */
+   struct thread* caller = 0;
+   struct thread* sender;
+
+   if (0 != current_thread->edi)
+   {
+    caller = deliver_reply(current_thread, current_thread->edi,
+                           current_thread->esi, current_thread->ebx);
+    if (0 == caller)
+    {
+     current_thread->eax = ERROR;
+     break;
+    }
+   }
+
+   sender = thread_queue_dequeue(&current_thread->senders);
+   if (0 != sender)
+   {
+    deliver_message(sender, current_thread);
+    if (0 != caller)
+     make_ready(caller);
+    break;
+   }
+
+   current_thread->state = THREAD_RECEIVING;
+   if (0 != caller)
+    hand_off(caller);
+   else
+    schedule();
+   break;
+  }
+
+  case SYSCALL_REPLY:
+  {
+   /* The thread to reply to is passed in edi and the reply in esi and
+      ebx. The caller continues. */
+   struct thread* const caller = deliver_reply(current_thread,
+                                               current_thread->edi,
+                                               current_thread->esi,
+                                               current_thread->ebx);
+
+   if (0 == caller)
+   {
+    current_thread->eax = ERROR;
+    break;
+   }
+
+   current_thread->eax = ALL_OK;
+   make_ready(caller);
+   break;
+  }
+
+  case SYSCALL_THREAD_ID:
+  {
+   current_thread->eax = current_thread->id;
+   break;
+  }
+
+  case SYSCALL_SHARE_MEMORY:
+  {
+   /* A thread of the process to share with is passed in edi and the size
+      in esi. The memory is mapped at the same address in both processes,
+      so the address can be handed to the other process in a message. */
+   struct thread* const peer = find_thread(current_thread->edi);
+   uintptr_t            address;
+
+   if ((0 == peer) || peer->process->terminating)
+   {
+    current_thread->eax = ERROR;
+    break;
+   }
+
+   address = address_space_share(current_process->address_space,
+                                 peer->process->address_space,
+                                 current_thread->esi);
+   current_thread->eax = (0 != address) ? (int32_t) address : ERROR;
+   break;
+  }
+
+  case SYSCALL_ASYNC_SETUP:
+  {
+   /* The number of submission entries is passed in edi. The rings are
+      mapped like shared memory, so the kernel reaches them through the
+      kernel mappings whichever process runs. */
+   uint32_t            entries = 1;
+   uintptr_t           address;
+   struct async_rings* rings;
+
+   if ((0 != current_process->async_rings) || (0 == current_thread->edi) ||
+       (current_thread->edi > ASYNC_MAX_ENTRIES))
+   {
+    current_thread->eax = ERROR;
+    break;
+   }
+
+   while (entries < current_thread->edi)
+    entries *= 2;
+
+   address = address_space_share(current_process->address_space,
+                                 current_process->address_space,
+                                 ASYNC_SIZE(entries));
+   if (0 == address)
+   {
+    current_thread->eax = ERROR;
+    break;
+   }
+
+   current_process->async_rings = address;
+   current_process->async_entries = entries;
+   current_process->async_owner = current_thread;
+   current_process->async_next = async_processes;
+   async_processes = current_process;
+
+   rings = async_address(current_process, 0);
+   rings->submission_entries = entries;
+   rings->completion_entries = 2 * entries;
+   rings->submissions = ASYNC_SUBMISSIONS;
+   rings->completions = ASYNC_COMPLETIONS(entries);
+
+   current_thread->eax = address;
+   break;
+  }
+
+  case SYSCALL_ASYNC_ENTER:
+  {
+   if (0 == current_process->async_rings)
+   {
+    current_thread->eax = ERROR;
+    break;
+   }
+
+   current_thread->eax = async_drain(current_process);
+   break;
+  }
+
+  case SYSCALL_ALLOCATE:
+  {
+   /* The length is passed in edi. Hand back the address of the block or
+      ERROR when no block of that size is available. The block belongs to
+      the calling process. */
+   current_thread->eax = allocate_memory(current_thread->edi, 0, 0);
+   break;
+  }
+
+  case SYSCALL_FREE:
+  {
+   /* The address is passed in edi. Refuse addresses that do not refer to a
+      block handed out by SYSCALL_ALLOCATE to the calling process. */
+   current_thread->eax = free_memory(current_thread->edi);
+   break;
+  }
+
+  case SYSCALL_ALLOCATE_ALIGNED:
+  {
+   /* The length is passed in edi and the alignment in esi. */
+   current_thread->eax = allocate_memory(current_thread->edi,
+                                         current_thread->esi, 0);
+   break;
+  }
+
+  case SYSCALL_ALLOCATE_ZEROED:
+  {
+   /* The length is passed in edi. */
+   current_thread->eax = allocate_memory(current_thread->edi, 0, 1);
+   break;
+  }
+
+  case SYSCALL_RESIZE:
+  {
+   /* The address is passed in edi and the new length in esi. */
+   current_thread->eax = resize_memory(current_thread->edi,
+                                       current_thread->esi);
+   break;
+  }
+
+  case SYSCALL_MEMORY_BATCH:
+  {
+   /* The requests are passed in edi and their number in esi. The results
+      are written back into the requests. */
+   struct memory_request* const requests =
+    (struct memory_request*) current_thread->edi;
+   const uint32_t               count = current_thread->esi;
+   uint32_t                     i;
+
+   if ((count > UINT32_MAX / sizeof(struct memory_request)) ||
+       !address_space_is_writable(current_process->address_space,
+                                  (uintptr_t) requests,
+                                  count * sizeof(struct memory_request)))
+   {
+    current_thread->eax = ERROR;
+    break;
+   }
+
+   for (i = 0; i < count; i++)
+    switch (requests[i].operation)
+    {
+     case SYSCALL_ALLOCATE:
+      requests[i].result = allocate_memory(requests[i].argument, 0, 0);
+      break;
+     case SYSCALL_FREE:
+      requests[i].result = free_memory(requests[i].argument);
+      break;
+     default:
+      requests[i].result = ERROR_ILLEGAL_SYSCALL;
+    }
+
+   current_thread->eax = ALL_OK;
+   break;
+  }
+
+  case SYSCALL_MEMORY_STATISTICS:
+  {
+   /* The address of the structure to fill in is passed in edi. */
+   struct memory_statistics* const statistics =
+    (struct memory_statistics*) current_thread->edi;
+
+   if (!address_space_is_writable(current_process->address_space,
+                                  (uintptr_t) statistics,
+                                  sizeof(struct memory_statistics)))
+   {
+    current_thread->eax = ERROR;
+    break;
+   }
+
+   report_memory(statistics);
+   current_thread->eax = ALL_OK;
+   break;
+  }
+
+  default:
+  {
+   /* Unrecognized system call. Not good. */
+   current_thread->eax = ERROR_ILLEGAL_SYSCALL;
+  }
+ }
+
+ go_to_user_space();
+}
+
+void handle_page_fault(const uint32_t error_code)
+{
+ /* Faults in the kernel happen with the kernel lock held. */
+ if (error_code & PAGE_FAULT_USER)
+ {
+  kernel_lock_acquire();
+
+  if (current_process->terminating)
+  {
+   terminate_thread();
+   go_to_user_space();
+  }
+ }
+
+ /* Faults on heap pages that have not been touched yet are resolved by
+    mapping a zeroed frame. This also happens in the kernel, when it clears
+    or copies blocks on behalf of a process. */
+ if ((0 != current_process) &&
+     address_space_handle_fault(current_process->address_space, read_cr2(),
+                                error_code))
+ {
+  if (error_code & PAGE_FAULT_USER)
+   kernel_lock_release();
+  return;
+ }
+
+ /* Any other fault in the kernel is a bug. */
+ if (!(error_code & PAGE_FAULT_USER))
+  halt_the_machine();
+
+ kprints("Process terminated on page fault at ");
+ kprinthex(read_cr2());
+ terminate_process();
+ go_to_user_space();
+}
+
+void handle_device_not_available(void)
+{
+ struct cpu* const cpu = this_cpu();
+
+ kernel_lock_acquire();
+
+ if (current_process->terminating)
+ {
+  terminate_thread();
+  go_to_user_space();
+ }
+
+ if (!fpu_available)
+ {
+  kprints("Process terminated, the processor can not switch the FPU\n");
+  terminate_process();
+  go_to_user_space();
+ }
+
+ /* The first time a thread uses the FPU it gets registers in their state
+    after reset, rather than those of the last thread. */
+ if (0 == current_thread->fpu_state)
+ {
+  uint32_t* const state = object_cache_allocate(&fpu_state_cache);
+  int             i;
+
+  if (0 == state)
+  {
+   kprints("Process terminated, out of memory for the FPU state\n");
+   terminate_process();
+   go_to_user_space();
+  }
+
+  for (i = 0; i < FPU_STATE_SIZE / sizeof(uint32_t); i++)
+   state[i] = 0;
+  state[0] = FPU_CONTROL_DEFAULT;
+  state[6] = MXCSR_DEFAULT;
+
+  current_thread->fpu_state = state;
+ }
+
+ /* Write the registers back to the thread that last used them on this cpu
+    and load those of the current thread. */
+ clts();
+ if (0 != cpu->fpu_owner)
+  fxsave(cpu->fpu_owner->fpu_state);
+ fxrstor(current_thread->fpu_state);
+ cpu->fpu_owner = current_thread;
+
+ go_to_user_space();
+}
+
+void handle_timer_interrupt(void)
+{
+ timer_acknowledge();
+ kernel_lock_acquire();
+
+ /* Only the boot cpu gets interrupts from the interval timer, so it does
+    the boosts for all cpus. */
+ if (timer_ticks - last_priority_boost >= PRIORITY_BOOST_INTERVAL)
+  boost_priorities();
+
+ if (0 != async_timers)
+  async_expire_timers();
+
+ tick();
+}
+
+void handle_apic_timer_interrupt(void)
+{
+ apic_acknowledge();
+ kernel_lock_acquire();
+ tick();
+}
+
+void ap_init(const uint32_t id)
+{
+ paging_init_cpu();
+ smp_cpu_init(id, cpu_stacks[id]);
+ fpu_init_cpu();
+ lidt(sizeof(idt) - 1, (uintptr_t) idt);
+ smp_start_timer(TIMER_FREQUENCY);
+
+ kernel_lock_acquire();
+ schedule();
+ go_to_user_space();
+}
@@ -5,13 +5,1468 @@
    file 'LICENSE', which is part of this source code package.
  */
 
-/*! \file mm.c This file holds implementations of memory 
+/*! \file mm.c This file holds implementations of memory
    management functions. */
 
 #include <stdint.h>
 #include "mm.h"
 
+/* The heap is a segregated-fit allocator. Every block, free or used, starts
+   with a header holding its size and two flag bits. Free blocks additionally
+   hold links into a free list and a copy of their size in the last word
+   (the boundary tag), so the block in front of any block can be found in
+   constant time when coalescing.
+
+   Free blocks are kept in one list per power-of-two size class. Class i
+   holds blocks whose size is in [2^i, 2^(i+1)). A bitmap records which
+   lists are non-empty so the search for a list that is guaranteed to hold
+   a large enough block is a single bit scan. */
+
+/*! Alignment of all block sizes and payload addresses. */
+#define HEAP_ALIGNMENT         (2*sizeof(size_t))
+
+/*! The block is handed out to a caller. */
+#define BLOCK_USED             ((size_t) 1)
+
+/*! The block located in front of this block is handed out to a caller.
+    The boundary tag of the previous block is only valid when this flag is
+    cleared. */
+#define BLOCK_PREVIOUS_USED    ((size_t) 2)
+
+/*! Mask used to extract the size of a block from its header. */
+#define BLOCK_SIZE_MASK        (~(HEAP_ALIGNMENT-1))
+
+/*! Value mixed with the block address and the address of the owning heap
+    and stored in the header of used blocks. Used to reject addresses not
+    handed out by the heap they are returned to. */
+#define BLOCK_MAGIC            ((size_t) 0x6d6d4f4bU)
+
+/*! Defines the header found first in every block. */
+struct block
+{
+ size_t size;           /*!< Size of the block in bytes, including the
+                             header. The lowest bits hold BLOCK_USED and
+                             BLOCK_PREVIOUS_USED. */
+ size_t magic;          /*!< BLOCK_MAGIC xor the block address xor the
+                             key of the heap while the block is used. */
+ /* The members below are only valid while the block is free. */
+ struct block* next_free; /*!< Next block in the same size class. */
+ struct block* prev_free; /*!< Previous block in the same size class. */
+};
+
+/*! Size of the part of the header that is present in used blocks. */
+#define BLOCK_HEADER_SIZE      (2*sizeof(size_t))
+
+/*! The smallest block that can hold the free list links and the boundary
+    tag, rounded up to the alignment. */
+#define BLOCK_MIN_SIZE         ((sizeof(struct block) + sizeof(size_t) + \
+                                 HEAP_ALIGNMENT - 1) & BLOCK_SIZE_MASK)
+
+/*! The smallest order of frame blocks the kernel heap grows by. */
+#define HEAP_GROW_MIN_ORDER    (4)
+
+/*! The heap used by embedded_malloc and embedded_free. It grows on demand
+    with memory from the page frame allocator. */
+static struct heap kernel_heap;
+
+/* Extent heaps keep their bookkeeping apart from the memory they manage.
+   Every block, free or used, is described by a struct extent taken from an
+   object cache. The extents are linked in address order, so the neighbours
+   of a block are found in constant time when coalescing, and free extents
+   are kept in one list per size class as in the heap above. Used extents
+   are hashed on their start address, which is the address handed out, so
+   an address passed back is looked up rather than trusted.
+
+   The managed memory is never read or written. It can therefore be memory
+   a process can write, whose contents must not steer the kernel. */
+
+/*! Defines the bookkeeping of one block of an extent heap. */
+struct extent
+{
+ uintptr_t      start;         /*!< Address of the first byte. */
+ size_t         size;          /*!< Size in bytes. */
+ struct extent* previous;      /*!< The block in front, or 0. */
+ struct extent* next;          /*!< The block after, or 0. */
+ struct extent* link_next;     /*!< Next extent in the same free list or
+                                    hash chain. */
+ struct extent* link_previous; /*!< Previous extent in the same free list.
+                                    Only valid while the block is free. */
+ int            used;          /*!< Set while the block is handed out. */
+};
+
+/*! Smallest number of hash buckets of an extent heap with used blocks. */
+#define EXTENT_MIN_BUCKETS     (64)
+
+/*! Cache holding the extents of all extent heaps. */
+static struct object_cache extent_cache;
+
+/* Helper functions. */
+
+static inline size_t
+block_size(const struct block* const b)
+{
+ return b->size & BLOCK_SIZE_MASK;
+}
+
+static inline struct block*
+block_next(const struct block* const b)
+{
+ return (struct block*) ((uintptr_t) b + block_size(b));
+}
+
+/*! Returns the block in front of b. Only valid when b does not have
+    BLOCK_PREVIOUS_USED set. */
+static inline struct block*
+block_previous(const struct block* const b)
+{
+ const size_t previous_size = *(((const size_t*) b) - 1);
+ return (struct block*) ((uintptr_t) b - previous_size);
+}
+
+/*! Writes the boundary tag at the end of a free block. */
+static inline void
+block_set_tag(struct block* const b)
+{
+ *((size_t*) block_next(b) - 1) = block_size(b);
+}
+
+/*! Returns the index of the most significant bit set in a non-zero
+    value. */
+static inline int
+floor_log2(const size_t value)
+{
+ return (8 * sizeof(unsigned long) - 1) - __builtin_clzl(value);
+}
+
+static void
+heap_insert(struct heap* const h, struct block* const b)
+{
+ const int class = floor_log2(block_size(b));
+
+ b->prev_free = 0;
+ b->next_free = h->free_lists[class];
+ if (0 != b->next_free)
+  b->next_free->prev_free = b;
+ h->free_lists[class] = b;
+ h->class_bitmap |= 1U << class;
+
+ block_set_tag(b);
+ block_next(b)->size &= ~BLOCK_PREVIOUS_USED;
+}
+
+static void
+heap_remove(struct heap* const h, struct block* const b)
+{
+ const int class = floor_log2(block_size(b));
+
+ if (0 != b->next_free)
+  b->next_free->prev_free = b->prev_free;
+ if (0 != b->prev_free)
+  b->prev_free->next_free = b->next_free;
+ else
+ {
+  h->free_lists[class] = b->next_free;
+  if (0 == b->next_free)
+   h->class_bitmap &= ~(1U << class);
+ }
+}
+
+/*! Finds and unlinks a free block of at least size bytes. Returns 0 if
+    there is no such block. */
+static struct block*
+heap_find(struct heap* const h, const size_t size)
+{
+ int      class = floor_log2(size);
+ uint32_t candidates;
+
+ if (class >= HEAP_CLASSES)
+  return 0;
+
+ /* Every block in a class above the one size belongs to is large enough.
+    A size that is an exact power of two is satisfied by its own class. */
+ if (size & (size - 1))
+  candidates = (class + 1 < HEAP_CLASSES) ?
+               h->class_bitmap & ~((2U << class) - 1) : 0;
+ else
+  candidates = h->class_bitmap & ~((1U << class) - 1);
+
+ if (0 != candidates)
+ {
+  struct block* const b = h->free_lists[__builtin_ctz(candidates)];
+  heap_remove(h, b);
+  return b;
+ }
+
+ /* Nothing in the larger classes. Only the first block of the class the
+    size belongs to is looked at, so the search stays constant time. A fit
+    further down that list is missed, and the heap grows instead. The first
+    block is the one freed or added last, which covers a heap that just
+    grew for this request. */
+ {
+  struct block* const b = h->free_lists[class];
+
+  if ((0 != b) && (block_size(b) >= size))
+  {
+   heap_remove(h, b);
+   return b;
+  }
+ }
+
+ return 0;
+}
+
+/*! Returns the block holding ptr if ptr was returned by heap_allocate and
+    has not been freed since. Returns 0 otherwise. */
+static struct block*
+heap_lookup(const struct heap* const h, const void* const ptr)
+{
+ const uintptr_t address = (uintptr_t) ptr;
+ struct block*   b;
+
+ if ((address & (HEAP_ALIGNMENT - 1)) ||
+     (address < h->start + BLOCK_HEADER_SIZE) ||
+     (address >= h->end))
+  return 0;
+
+ b = (struct block*) (address - BLOCK_HEADER_SIZE);
+ if (!(b->size & BLOCK_USED) ||
+     (b->magic != (BLOCK_MAGIC ^ (uintptr_t) b ^ h->key)))
+  return 0;
+
+ return b;
+}
+
+/*! Returns the size of the block needed to hold length bytes, or 0 if
+    length is 0 or too large for any block. */
+static size_t
+request_size(const size_t length)
+{
+ size_t size;
+
+ if ((0 == length) || (length > (size_t) -1 - BLOCK_MIN_SIZE))
+  return 0;
+
+ size = (length + BLOCK_HEADER_SIZE + HEAP_ALIGNMENT - 1) & BLOCK_SIZE_MASK;
+ return (size < BLOCK_MIN_SIZE) ? BLOCK_MIN_SIZE : size;
+}
+
+/*! Hands out the first size bytes of the free block b, which must not be in
+    the free lists, and returns the rest of it to the heap. */
+static void*
+heap_use_block(struct heap* const h, struct block* const b, const size_t size)
+{
+ /* Give back what is not needed. */
+ if (block_size(b) - size >= BLOCK_MIN_SIZE)
+ {
+  struct block* const rest = (struct block*) ((uintptr_t) b + size);
+
+  rest->size = (block_size(b) - size) | BLOCK_PREVIOUS_USED;
+  b->size = size | (b->size & BLOCK_PREVIOUS_USED);
+  heap_insert(h, rest);
+ }
+ else
+  block_next(b)->size |= BLOCK_PREVIOUS_USED;
+
+ b->size |= BLOCK_USED;
+ b->magic = BLOCK_MAGIC ^ (uintptr_t) b ^ h->key;
+ h->used += block_size(b);
+
+ return (void*) ((uintptr_t) b + BLOCK_HEADER_SIZE);
+}
+
+/*! Returns a used block to the heap. */
+static void
+heap_free_block(struct heap* const h, struct block* b)
+{
+ struct block* next = block_next(b);
+
+ b->size &= ~BLOCK_USED;
+ b->magic = 0;
+
+ /* Coalesce with the neighbours right away so no two free blocks are ever
+    adjacent. */
+ if (!(next->size & BLOCK_USED))
+ {
+  heap_remove(h, next);
+  b->size += block_size(next);
+ }
+
+ if (!(b->size & BLOCK_PREVIOUS_USED))
+ {
+  struct block* const previous = block_previous(b);
+
+  heap_remove(h, previous);
+  previous->size += block_size(b);
+  b = previous;
+ }
+
+ heap_insert(h, b);
+}
+
+/* The page frame allocator is a binary buddy allocator. A block of order k
+   is 2^k frames long and starts at a frame number that is a multiple of 2^k,
+   so the buddy of a block is found by flipping bit k of its frame number.
+   Free blocks are kept in one list per order. The lists are threaded through
+   the free frames themselves.
+
+   One bit per frame records whether the frame starts a free block. Together
+   with the order stored in the free block this tells in constant time if a
+   buddy can be merged. */
+
+/*! Number of bits in each word of the frame bitmap. */
+#define FRAME_BITMAP_BITS      (8*sizeof(uint32_t))
+
+/*! Defines the header stored in the first frame of a free block. */
+struct free_frames
+{
+ struct free_frames* next;     /*!< Next free block of the same order. */
+ struct free_frames* previous; /*!< Previous free block of the same order. */
+ uint32_t            order;    /*!< The order of this block. */
+};
+
+/*! Free blocks of frames per order. */
+static struct free_frames* frame_lists[FRAME_MAX_ORDER + 1];
+
+/*! Bit i is set when frame i starts a free block. */
+static uint32_t* frame_bitmap;
+
+/*! Number of frames covered by frame_bitmap. */
+static uintptr_t frame_count;
+
+/*! Entry i holds the number of references to frame i beyond the first one.
+    A frame is only freed by frame_release when no other reference is
+    left. */
+static uint16_t* frame_shares;
+
+static inline uintptr_t
+frame_number(const void* const address)
+{
+ return (uintptr_t) address / FRAME_SIZE;
+}
+
+static inline struct free_frames*
+frame_address(const uintptr_t frame)
+{
+ return (struct free_frames*) (frame * FRAME_SIZE);
+}
+
+static inline int
+frame_is_free_head(const uintptr_t frame)
+{
+ return (frame < frame_count) &&
+        (frame_bitmap[frame / FRAME_BITMAP_BITS] &
+         (1U << (frame % FRAME_BITMAP_BITS)));
+}
+
+static void
+frame_push(const uintptr_t frame, const uint32_t order)
+{
+ struct free_frames* const f = frame_address(frame);
+
+ f->order = order;
+ f->previous = 0;
+ f->next = frame_lists[order];
+ if (0 != f->next)
+  f->next->previous = f;
+ frame_lists[order] = f;
+
+ frame_bitmap[frame / FRAME_BITMAP_BITS] |= 1U << (frame % FRAME_BITMAP_BITS);
+}
+
+static void
+frame_unlink(struct free_frames* const f)
+{
+ const uintptr_t frame = frame_number(f);
+
+ if (0 != f->next)
+  f->next->previous = f->previous;
+ if (0 != f->previous)
+  f->previous->next = f->next;
+ else
+  frame_lists[f->order] = f->next;
+
+ frame_bitmap[frame / FRAME_BITMAP_BITS] &=
+  ~(1U << (frame % FRAME_BITMAP_BITS));
+}
+
+/*! Hands the frames [start, end) to the frame allocator as the largest
+    aligned blocks that fit. The blocks are freed from the top down so the
+    lowest addresses end up first in the lists. Blocks are merged with free
+    buddies handed over earlier. */
+static void
+frame_add_range(const uintptr_t start, const uintptr_t end)
+{
+ uintptr_t frame = end;
+
+ while (frame > start)
+ {
+  uint32_t order = 0;
+
+  while ((order < FRAME_MAX_ORDER) &&
+         !(frame & ((2U << order) - 1)) &&
+         (frame - (2U << order) >= start))
+   order++;
+
+  frame -= 1U << order;
+  frame_free(frame_address(frame), order);
+ }
+}
+
+/*! Takes a block of frames that can hold a heap block of size bytes and
+    hands it to a heap. A block of 2^preferred_order frames is taken if
+    possible so the heap does not have to grow again soon. Returns zero if
+    there are not enough frames left or the block would not fit in the
+    largest block of frames. */
+static int
+heap_grow(struct heap* const h, const size_t size,
+          const uint32_t preferred_order)
+{
+ uint32_t needed = 0;
+ uint32_t order;
+ void*    frames;
+
+ /* Leave room for the header of the first block and the end sentinel. A
+    request larger than the largest block of frames is refused, as growing
+    would only hand over blocks that are not next to each other. */
+ if (size > ((size_t) FRAME_SIZE << FRAME_MAX_ORDER) - 2*BLOCK_MIN_SIZE)
+  return 0;
+
+ while ((needed < FRAME_MAX_ORDER) &&
+        (((size_t) FRAME_SIZE << needed) < size + 2*BLOCK_MIN_SIZE))
+  needed++;
+
+ /* Fall back to smaller blocks when memory is tight. */
+ order = (preferred_order > needed) ? preferred_order : needed;
+ while (0 == (frames = frame_allocate(order)))
+ {
+  if (needed == order)
+   return 0;
+  order--;
+ }
+
+ heap_add_region(h, (uintptr_t) frames,
+                 (uintptr_t) frames + ((uintptr_t) FRAME_SIZE << order));
+ return 1;
+}
+
+/* Definitions. */
+
 void initialize(void)
 {
- /* Implement me. */
+ size_t bitmap_words;
+ size_t i;
+
+ /* The frame bitmap is stored first in the available memory and covers
+    every frame below the top of memory. */
+ frame_count = top_of_available_physical_memory / FRAME_SIZE;
+ bitmap_words = (frame_count + FRAME_BITMAP_BITS - 1) / FRAME_BITMAP_BITS;
+
+ frame_bitmap = (uint32_t*) ((lowest_available_physical_memory +
+                              sizeof(uint32_t) - 1) &
+                             ~(uintptr_t) (sizeof(uint32_t) - 1));
+ for (i = 0; i < bitmap_words; i++)
+  frame_bitmap[i] = 0;
+
+ /* The share counts follow the bitmap. */
+ frame_shares = (uint16_t*) (frame_bitmap + bitmap_words);
+ for (i = 0; i < frame_count; i++)
+  frame_shares[i] = 0;
+
+ lowest_available_physical_memory = (uintptr_t) (frame_shares + frame_count);
+
+ for (i = 0; i <= FRAME_MAX_ORDER; i++)
+  frame_lists[i] = 0;
+
+ heap_init(&kernel_heap);
+ object_cache_init(&extent_cache, "heap extent", sizeof(struct extent));
+}
+
+void frame_add_memory(const uintptr_t start, const uintptr_t end)
+{
+ const uintptr_t first = (start + FRAME_SIZE - 1) / FRAME_SIZE;
+ uintptr_t       last  = end / FRAME_SIZE;
+
+ if (last > frame_count)
+  last = frame_count;
+
+ if (first < last)
+  frame_add_range(first, last);
+}
+
+void* frame_allocate(const unsigned int order)
+{
+ unsigned int current;
+
+ for (current = order; current <= FRAME_MAX_ORDER; current++)
+  if (0 != frame_lists[current])
+  {
+   struct free_frames* const f     = frame_lists[current];
+   const uintptr_t           frame = frame_number(f);
+
+   frame_unlink(f);
+
+   /* Split off the upper halves until the block has the requested
+      order. */
+   while (current > order)
+   {
+    current--;
+    frame_push(frame + (1U << current), current);
+   }
+
+   return f;
+  }
+
+ return 0;
+}
+
+void frame_free(void* const frames, unsigned int order)
+{
+ uintptr_t frame = frame_number(frames);
+
+ while (order < FRAME_MAX_ORDER)
+ {
+  const uintptr_t buddy = frame ^ (1U << order);
+
+  if (!frame_is_free_head(buddy) || (frame_address(buddy)->order != order))
+   break;
+
+  frame_unlink(frame_address(buddy));
+  frame &= ~(uintptr_t) (1U << order);
+  order++;
+ }
+
+ frame_push(frame, order);
+}
+
+void frame_share(void* const frame)
+{
+ frame_shares[frame_number(frame)]++;
+}
+
+int frame_is_shared(const void* const frame)
+{
+ return 0 != frame_shares[frame_number(frame)];
+}
+
+void frame_release(void* const frame)
+{
+ uint16_t* const shares = &frame_shares[frame_number(frame)];
+
+ if (0 != *shares)
+  (*shares)--;
+ else
+  frame_free(frame, 0);
+}
+
+void heap_init(struct heap* const h)
+{
+ int class;
+
+ h->class_bitmap = 0;
+ for (class = 0; class < HEAP_CLASSES; class++)
+  h->free_lists[class] = 0;
+ h->start = UINTPTR_MAX;
+ h->end = 0;
+ h->key = (uintptr_t) h;
+ h->used = 0;
+}
+
+void* heap_allocate(struct heap* const h, const size_t length)
+{
+ const size_t  size = request_size(length);
+ struct block* b;
+
+ if (0 == size)
+  return 0;
+
+ b = heap_find(h, size);
+ if (0 == b)
+  return 0;
+
+ return heap_use_block(h, b, size);
+}
+
+void* heap_allocate_aligned(struct heap* const h, const size_t length,
+                            const size_t alignment)
+{
+ const size_t  size = request_size(length);
+ struct block* b;
+ uintptr_t     payload;
+
+ if (alignment & (alignment - 1))
+  return 0;
+ if (alignment <= HEAP_ALIGNMENT)
+  return heap_allocate(h, length);
+
+ if ((0 == size) || (size > (size_t) -1 - alignment - BLOCK_MIN_SIZE))
+  return 0;
+
+ /* Room for the block, for the padding up to the alignment and for a free
+    block in front of it. */
+ b = heap_find(h, size + alignment + BLOCK_MIN_SIZE);
+ if (0 == b)
+  return 0;
+
+ /* Give back what is in front of the first aligned address that leaves
+    room for a free block there. */
+ payload = ((uintptr_t) b + BLOCK_HEADER_SIZE + alignment - 1) &
+           ~(uintptr_t) (alignment - 1);
+ if (payload != (uintptr_t) b + BLOCK_HEADER_SIZE)
+ {
+  struct block* aligned;
+  size_t        gap;
+
+  if (payload - BLOCK_HEADER_SIZE - (uintptr_t) b < BLOCK_MIN_SIZE)
+   payload += alignment;
+
+  aligned = (struct block*) (payload - BLOCK_HEADER_SIZE);
+  gap = (uintptr_t) aligned - (uintptr_t) b;
+
+  aligned->size = block_size(b) - gap;
+  b->size = gap | (b->size & BLOCK_PREVIOUS_USED);
+  heap_insert(h, b);
+  b = aligned;
+ }
+
+ return heap_use_block(h, b, size);
+}
+
+int heap_free(struct heap* const h, void* const ptr)
+{
+ struct block* const b = heap_lookup(h, ptr);
+
+ if (0 == b)
+  return 0;
+
+ h->used -= block_size(b);
+ heap_free_block(h, b);
+ return 1;
+}
+
+void heap_report(const struct heap* const h,
+                 struct heap_statistics* const statistics)
+{
+ int class;
+
+ statistics->used_bytes = h->used;
+ statistics->largest_free_block = 0;
+
+ for (class = 0; class < HEAP_CLASSES; class++)
+ {
+  const struct block* b;
+
+  statistics->free_bytes[class] = 0;
+  for (b = h->free_lists[class]; 0 != b; b = b->next_free)
+  {
+   statistics->free_bytes[class] += block_size(b);
+   if (block_size(b) > statistics->largest_free_block)
+    statistics->largest_free_block = block_size(b);
+  }
+ }
+}
+
+int heap_resize(struct heap* const h, void* const ptr, const size_t length)
+{
+ struct block* const b    = heap_lookup(h, ptr);
+ const size_t        size = request_size(length);
+
+ if ((0 == b) || (0 == size))
+  return 0;
+
+ /* Grow into the following block if it is free and large enough. */
+ if (block_size(b) < size)
+ {
+  struct block* const next = block_next(b);
+
+  if ((next->size & BLOCK_USED) || (block_size(b) + block_size(next) < size))
+   return 0;
+
+  heap_remove(h, next);
+  h->used += block_size(next);
+  b->size += block_size(next);
+  block_next(b)->size |= BLOCK_PREVIOUS_USED;
+ }
+
+ /* Give back what is not needed. It is merged with the following block if
+    that one is free. */
+ if (block_size(b) - size >= BLOCK_MIN_SIZE)
+ {
+  struct block* const rest = (struct block*) ((uintptr_t) b + size);
+
+  rest->size = (block_size(b) - size) | BLOCK_USED | BLOCK_PREVIOUS_USED;
+  b->size = size | (b->size & ~BLOCK_SIZE_MASK);
+  h->used -= block_size(rest);
+  heap_free_block(h, rest);
+ }
+
+ return 1;
+}
+
+size_t heap_usable_size(const struct heap* const h, const void* const ptr)
+{
+ const struct block* const b = heap_lookup(h, ptr);
+
+ return (0 != b) ? block_size(b) - BLOCK_HEADER_SIZE : 0;
+}
+
+void heap_add_region(struct heap* const h, const uintptr_t start,
+                     const uintptr_t end)
+{
+ const uintptr_t first = (start + HEAP_ALIGNMENT - 1) & BLOCK_SIZE_MASK;
+ const uintptr_t last  = (end - BLOCK_HEADER_SIZE) & BLOCK_SIZE_MASK;
+ struct block*   b;
+
+ if ((end < start) || (last < first + BLOCK_MIN_SIZE))
+  return;
+
+ if (first == h->end + BLOCK_HEADER_SIZE)
+ {
+  /* The old end sentinel becomes the header of the new memory. */
+  b = (struct block*) h->end;
+  b->size = (last - h->end) | BLOCK_USED | (b->size & BLOCK_PREVIOUS_USED);
+  h->end = last;
+ }
+ else
+ {
+  b = (struct block*) first;
+  if (last + BLOCK_HEADER_SIZE == h->start)
+  {
+   /* The first block of the heap follows the new memory directly. */
+   b->size = (h->start - first) | BLOCK_USED | BLOCK_PREVIOUS_USED;
+   h->start = first;
+   heap_free_block(h, b);
+   return;
+  }
+
+  /* Nothing is in front of the first block, pretend it is used. */
+  b->size = (last - first) | BLOCK_USED | BLOCK_PREVIOUS_USED;
+  if (first < h->start)
+   h->start = first;
+  if (last > h->end)
+   h->end = last;
+ }
+
+ /* The sentinel is a used block of size zero. It stops coalescing at the
+    end of the memory. */
+ ((struct block*) last)->size = BLOCK_USED | BLOCK_PREVIOUS_USED;
+
+ heap_free_block(h, b);
+}
+
+void* embedded_malloc(size_t size)
+{
+ void* block;
+
+ while (0 == (block = heap_allocate(&kernel_heap, size)))
+  if (!heap_grow(&kernel_heap, size, HEAP_GROW_MIN_ORDER))
+   return 0;
+
+ return block;
+}
+
+void embedded_free(void *ptr)
+{
+ heap_free(&kernel_heap, ptr);
+}
+
+int embedded_is_allocated(const void *ptr)
+{
+ return 0 != heap_lookup(&kernel_heap, ptr);
+}
+
+/* Object caches carve slabs of frames into equally sized objects. A slab is
+   a block of frames aligned to its size, with a struct slab first, so the
+   slab of an object is found by masking the address of the object. Free
+   objects are threaded into a list inside each slab. */
+
+/*! Defines the header found first in every slab. */
+struct slab
+{
+ struct slab*         next;         /*!< Next slab in the same list. */
+ struct slab*         previous;     /*!< Previous slab in the same list. */
+ void*                free_objects; /*!< List of free objects in the slab. */
+ size_t               active;       /*!< Number of objects handed out. */
+};
+
+/*! Offset of the first object in a slab. */
+#define SLAB_HEADER_SIZE       ((sizeof(struct slab) + CACHE_LINE_SIZE - 1) & \
+                                ~(CACHE_LINE_SIZE - 1))
+
+/*! Slabs are made large enough to hold at least this many objects. */
+#define SLAB_MIN_OBJECTS       (8)
+
+/*! List of all object caches. */
+static struct object_cache* object_caches;
+
+static void
+slab_link(struct slab** const list, struct slab* const slab)
+{
+ slab->previous = 0;
+ slab->next = *list;
+ if (0 != slab->next)
+  slab->next->previous = slab;
+ *list = slab;
+}
+
+static void
+slab_unlink(struct slab** const list, struct slab* const slab)
+{
+ if (0 != slab->next)
+  slab->next->previous = slab->previous;
+ if (0 != slab->previous)
+  slab->previous->next = slab->next;
+ else
+  *list = slab->next;
+}
+
+static struct slab*
+slab_create(struct object_cache* const cache)
+{
+ struct slab* const slab = (0 != cache->objects_per_slab) ?
+                           frame_allocate(cache->order) : 0;
+ uintptr_t          object;
+ size_t             i;
+
+ if (0 == slab)
+  return 0;
+
+ slab->free_objects = 0;
+ slab->active = 0;
+
+ /* Thread the objects in reverse so they are handed out in address
+    order. */
+ object = (uintptr_t) slab + SLAB_HEADER_SIZE +
+          cache->objects_per_slab * cache->object_size;
+ for (i = 0; i < cache->objects_per_slab; i++)
+ {
+  object -= cache->object_size;
+  *(void**) object = slab->free_objects;
+  slab->free_objects = (void*) object;
+ }
+
+ cache->slabs++;
+ return slab;
+}
+
+void object_cache_init(struct object_cache* const cache,
+                       const char* const name, const size_t object_size)
+{
+ cache->name = name;
+ cache->object_size = (object_size + CACHE_LINE_SIZE - 1) &
+                      ~(CACHE_LINE_SIZE - 1);
+ if (0 == cache->object_size)
+  cache->object_size = CACHE_LINE_SIZE;
+
+ cache->order = 0;
+ while ((cache->order < FRAME_MAX_ORDER) &&
+        (((size_t) FRAME_SIZE << cache->order) - SLAB_HEADER_SIZE <
+         SLAB_MIN_OBJECTS * cache->object_size))
+  cache->order++;
+
+ cache->objects_per_slab = (((size_t) FRAME_SIZE << cache->order) -
+                            SLAB_HEADER_SIZE) / cache->object_size;
+ cache->partial_slabs = 0;
+ cache->full_slabs = 0;
+ cache->empty_slab = 0;
+ cache->active_objects = 0;
+ cache->slabs = 0;
+
+ cache->next = object_caches;
+ object_caches = cache;
+}
+
+void* object_cache_allocate(struct object_cache* const cache)
+{
+ struct slab* slab = cache->partial_slabs;
+ void*        object;
+
+ if (0 == slab)
+ {
+  if (0 != cache->empty_slab)
+  {
+   slab = cache->empty_slab;
+   cache->empty_slab = 0;
+  }
+  else if (0 == (slab = slab_create(cache)))
+   return 0;
+  slab_link(&cache->partial_slabs, slab);
+ }
+
+ object = slab->free_objects;
+ slab->free_objects = *(void**) object;
+ slab->active++;
+ cache->active_objects++;
+
+ if (0 == slab->free_objects)
+ {
+  slab_unlink(&cache->partial_slabs, slab);
+  slab_link(&cache->full_slabs, slab);
+ }
+
+ return object;
+}
+
+void object_cache_free(struct object_cache* const cache, void* const object)
+{
+ struct slab* const slab =
+  (struct slab*) ((uintptr_t) object &
+                  ~(((uintptr_t) FRAME_SIZE << cache->order) - 1));
+
+ if (0 == slab->free_objects)
+ {
+  slab_unlink(&cache->full_slabs, slab);
+  slab_link(&cache->partial_slabs, slab);
+ }
+
+ *(void**) object = slab->free_objects;
+ slab->free_objects = object;
+ slab->active--;
+ cache->active_objects--;
+
+ if (0 == slab->active)
+ {
+  /* Keep one empty slab around so a cache that hovers around a slab
+     boundary does not keep going back to the frame allocator. */
+  slab_unlink(&cache->partial_slabs, slab);
+  if (0 == cache->empty_slab)
+   cache->empty_slab = slab;
+  else
+  {
+   frame_free(slab, cache->order);
+   cache->slabs--;
+  }
+ }
+}
+
+void object_cache_report(void (*hook)(const struct object_cache_statistics*))
+{
+ struct object_cache* cache;
+
+ for (cache = object_caches; 0 != cache; cache = cache->next)
+ {
+  struct object_cache_statistics statistics;
+
+  statistics.name = cache->name;
+  statistics.active_objects = cache->active_objects;
+  statistics.slabs = cache->slabs;
+  statistics.bytes = cache->slabs * ((size_t) FRAME_SIZE << cache->order);
+  hook(&statistics);
+ }
+}
+
+/* Extent heaps, see struct extent. */
+
+/*! Returns the hash chain of the used block starting at start. */
+static struct extent**
+extent_bucket(const struct extent_heap* const h, const uintptr_t start)
+{
+ const uintptr_t key = start / HEAP_ALIGNMENT;
+
+ return &h->buckets[(key ^ (key >> 10) ^ (key >> 20)) &
+                    (h->bucket_count - 1)];
+}
+
+/*! Returns a new extent covering [start, start + size), or 0 if memory is
+    exhausted. */
+static struct extent*
+extent_create(const uintptr_t start, const size_t size)
+{
+ struct extent* const e = object_cache_allocate(&extent_cache);
+
+ if (0 != e)
+ {
+  e->start = start;
+  e->size = size;
+  e->used = 0;
+ }
+
+ return e;
+}
+
+static void
+extent_insert_free(struct extent_heap* const h, struct extent* const e)
+{
+ const int class = floor_log2(e->size);
+
+ e->used = 0;
+ e->link_previous = 0;
+ e->link_next = h->free_lists[class];
+ if (0 != e->link_next)
+  e->link_next->link_previous = e;
+ h->free_lists[class] = e;
+ h->class_bitmap |= 1U << class;
+}
+
+static void
+extent_remove_free(struct extent_heap* const h, struct extent* const e)
+{
+ const int class = floor_log2(e->size);
+
+ if (0 != e->link_next)
+  e->link_next->link_previous = e->link_previous;
+ if (0 != e->link_previous)
+  e->link_previous->link_next = e->link_next;
+ else
+ {
+  h->free_lists[class] = e->link_next;
+  if (0 == e->link_next)
+   h->class_bitmap &= ~(1U << class);
+ }
+}
+
+/*! Links e in after previous in address order, or first if previous is 0. */
+static void
+extent_link_after(struct extent_heap* const h, struct extent* const previous,
+                  struct extent* const e)
+{
+ e->previous = previous;
+ e->next = (0 != previous) ? previous->next : h->first;
+ if (0 != e->next)
+  e->next->previous = e;
+ if (0 != previous)
+  previous->next = e;
+ else
+  h->first = e;
+}
+
+/*! Unlinks e from the address order and releases it. */
+static void
+extent_destroy(struct extent_heap* const h, struct extent* const e)
+{
+ if (h->last_found == e)
+  h->last_found = (0 != e->previous) ? e->previous : e->next;
+
+ if (0 != e->next)
+  e->next->previous = e->previous;
+ if (0 != e->previous)
+  e->previous->next = e->next;
+ else
+  h->first = e->next;
+
+ object_cache_free(&extent_cache, e);
+}
+
+/*! Doubles the hash table when it holds twice as many used blocks as it
+    has buckets. The old table is kept if memory is exhausted, only the
+    first table is needed. Returns zero if there is no table. */
+static int
+extent_grow_buckets(struct extent_heap* const h)
+{
+ const uint32_t  count = (0 == h->bucket_count) ? EXTENT_MIN_BUCKETS :
+                                                  2 * h->bucket_count;
+ struct extent** const old = h->buckets;
+ const uint32_t  old_count = h->bucket_count;
+ uint32_t        i;
+
+ if (h->used_blocks < 2 * h->bucket_count)
+  return 1;
+
+ h->buckets = embedded_malloc(count * sizeof(struct extent*));
+ if (0 == h->buckets)
+ {
+  h->buckets = old;
+  return 0 != old_count;
+ }
+
+ h->bucket_count = count;
+ for (i = 0; i < count; i++)
+  h->buckets[i] = 0;
+
+ for (i = 0; i < old_count; i++)
+  while (0 != old[i])
+  {
+   struct extent* const  e = old[i];
+   struct extent** const bucket = extent_bucket(h, e->start);
+
+   old[i] = e->link_next;
+   e->link_next = *bucket;
+   *bucket = e;
+  }
+
+ if (0 != old)
+  embedded_free(old);
+
+ return 1;
+}
+
+/*! Marks the free extent e, which must not be in the free lists, as used
+    and hashes it. */
+static void
+extent_use(struct extent_heap* const h, struct extent* const e)
+{
+ struct extent** const bucket = extent_bucket(h, e->start);
+
+ e->used = 1;
+ e->link_next = *bucket;
+ *bucket = e;
+ h->used_blocks++;
+ h->used += e->size;
+}
+
+/*! Returns the used extent starting at address, or 0 if address was not
+    handed out by the heap. If link is not 0 it is set to the pointer to the
+    extent in its hash chain. */
+static struct extent*
+extent_lookup(const struct extent_heap* const h, const uintptr_t address,
+              struct extent*** const link)
+{
+ struct extent** e;
+
+ if ((0 == h->bucket_count) || (address & (HEAP_ALIGNMENT - 1)))
+  return 0;
+
+ for (e = extent_bucket(h, address); 0 != *e; e = &(*e)->link_next)
+  if ((*e)->start == address)
+  {
+   if (0 != link)
+    *link = e;
+   return *e;
+  }
+
+ return 0;
+}
+
+/*! Returns the extent e, which must be free and in no list, to the free
+    lists, merged with the free blocks next to it. */
+static void
+extent_free(struct extent_heap* const h, struct extent* const e)
+{
+ struct extent* const next = e->next;
+ struct extent* const previous = e->previous;
+
+ if ((0 != next) && !next->used && (e->start + e->size == next->start))
+ {
+  extent_remove_free(h, next);
+  e->size += next->size;
+  extent_destroy(h, next);
+ }
+
+ if ((0 != previous) && !previous->used &&
+     (previous->start + previous->size == e->start))
+ {
+  extent_remove_free(h, previous);
+  previous->size += e->size;
+  extent_destroy(h, e);
+  extent_insert_free(h, previous);
+  return;
+ }
+
+ extent_insert_free(h, e);
+}
+
+/*! Finds and unlinks a free extent of at least size bytes, the same way
+    heap_find does. Returns 0 if there is no such extent. */
+static struct extent*
+extent_find(struct extent_heap* const h, const size_t size)
+{
+ const int      class = floor_log2(size);
+ uint32_t       candidates;
+ struct extent* e;
+
+ if (size & (size - 1))
+  candidates = (class + 1 < HEAP_CLASSES) ?
+               h->class_bitmap & ~((2U << class) - 1) : 0;
+ else
+  candidates = h->class_bitmap & ~((1U << class) - 1);
+
+ if (0 != candidates)
+  e = h->free_lists[__builtin_ctz(candidates)];
+ else
+ {
+  e = h->free_lists[class];
+  if ((0 == e) || (e->size < size))
+   return 0;
+ }
+
+ extent_remove_free(h, e);
+ return e;
+}
+
+/*! Returns the size of the block needed to hold length bytes, or 0 if
+    length is 0 or too large for any block. */
+static size_t
+extent_request_size(const size_t length)
+{
+ if ((0 == length) || (length > (size_t) -1 - HEAP_ALIGNMENT))
+  return 0;
+
+ return (length + HEAP_ALIGNMENT - 1) & BLOCK_SIZE_MASK;
+}
+
+void extent_heap_init(struct extent_heap* const h)
+{
+ int class;
+
+ h->class_bitmap = 0;
+ for (class = 0; class < HEAP_CLASSES; class++)
+  h->free_lists[class] = 0;
+ h->buckets = 0;
+ h->bucket_count = 0;
+ h->used_blocks = 0;
+ h->used = 0;
+ h->first = 0;
+ h->last_found = 0;
+}
+
+void extent_heap_destroy(struct extent_heap* const h)
+{
+ while (0 != h->first)
+  extent_destroy(h, h->first);
+
+ if (0 != h->buckets)
+  embedded_free(h->buckets);
+
+ extent_heap_init(h);
+}
+
+int extent_heap_clone(struct extent_heap* const copy,
+                      const struct extent_heap* const h)
+{
+ const struct extent* e;
+ struct extent*       last = 0;
+
+ extent_heap_init(copy);
+
+ if (0 != h->bucket_count)
+ {
+  uint32_t i;
+
+  copy->buckets = embedded_malloc(h->bucket_count * sizeof(struct extent*));
+  if (0 == copy->buckets)
+   return 0;
+  copy->bucket_count = h->bucket_count;
+  for (i = 0; i < copy->bucket_count; i++)
+   copy->buckets[i] = 0;
+ }
+
+ for (e = h->first; 0 != e; e = e->next)
+ {
+  struct extent* const c = extent_create(e->start, e->size);
+
+  if (0 == c)
+  {
+   extent_heap_destroy(copy);
+   return 0;
+  }
+
+  extent_link_after(copy, last, c);
+  if (e->used)
+   extent_use(copy, c);
+  else
+   extent_insert_free(copy, c);
+  last = c;
+ }
+
+ return 1;
+}
+
+int extent_heap_add_region(struct extent_heap* const h, const uintptr_t start,
+                           const uintptr_t end)
+{
+ const uintptr_t first = (start + HEAP_ALIGNMENT - 1) & BLOCK_SIZE_MASK;
+ const uintptr_t last  = end & BLOCK_SIZE_MASK;
+ struct extent*  previous = 0;
+ struct extent*  next = h->first;
+ struct extent*  e;
+
+ if ((end < start) || (last <= first))
+  return 1;
+
+ e = extent_create(first, last - first);
+ if (0 == e)
+  return 0;
+
+ while ((0 != next) && (next->start < first))
+ {
+  previous = next;
+  next = next->next;
+ }
+
+ extent_link_after(h, previous, e);
+ extent_free(h, e);
+ return 1;
+}
+
+void* extent_heap_allocate(struct extent_heap* const h, const size_t length,
+                           const size_t alignment)
+{
+ const size_t   size = extent_request_size(length);
+ const size_t   padding = (alignment > HEAP_ALIGNMENT) ?
+                          alignment - HEAP_ALIGNMENT : 0;
+ struct extent* e;
+ struct extent* front = 0;
+ struct extent* rest = 0;
+ uintptr_t      start;
+
+ if ((0 == size) || (alignment & (alignment - 1)) ||
+     (size > (size_t) -1 - padding))
+  return 0;
+
+ if (!extent_grow_buckets(h))
+  return 0;
+
+ e = extent_find(h, size + padding);
+ if (0 == e)
+  return 0;
+
+ /* Take the extents for the pieces left in front and behind before
+    anything is changed, so running out of memory leaves the heap as it
+    was. */
+ start = (padding != 0) ? (e->start + alignment - 1) & ~(alignment - 1) :
+                          e->start;
+ if (((start != e->start) &&
+      (0 == (front = extent_create(e->start, start - e->start)))) ||
+     ((start + size != e->start + e->size) &&
+      (0 == (rest = extent_create(start + size,
+                                  e->start + e->size - start - size)))))
+ {
+  if (0 != front)
+   object_cache_free(&extent_cache, front);
+  extent_insert_free(h, e);
+  return 0;
+ }
+
+ if (0 != front)
+ {
+  extent_link_after(h, e->previous, front);
+  extent_insert_free(h, front);
+ }
+ if (0 != rest)
+ {
+  extent_link_after(h, e, rest);
+  extent_insert_free(h, rest);
+ }
+
+ e->start = start;
+ e->size = size;
+ extent_use(h, e);
+
+ return (void*) start;
+}
+
+int extent_heap_free(struct extent_heap* const h, void* const ptr)
+{
+ struct extent** link;
+ struct extent* const e = extent_lookup(h, (uintptr_t) ptr, &link);
+
+ if (0 == e)
+  return 0;
+
+ *link = e->link_next;
+ h->used_blocks--;
+ h->used -= e->size;
+ extent_free(h, e);
+ return 1;
+}
+
+int extent_heap_resize(struct extent_heap* const h, void* const ptr,
+                       const size_t length)
+{
+ struct extent* const e = extent_lookup(h, (uintptr_t) ptr, 0);
+ const size_t         size = extent_request_size(length);
+ struct extent* const next = (0 != e) ? e->next : 0;
+ const int            next_free = (0 != next) && !next->used &&
+                                  (e->start + e->size == next->start);
+
+ if ((0 == e) || (0 == size))
+  return 0;
+
+ if (size > e->size)
+ {
+  /* Grow into the following block if it is free and large enough. */
+  if (!next_free || (e->size + next->size < size))
+   return 0;
+
+  extent_remove_free(h, next);
+  if (e->size + next->size == size)
+   extent_destroy(h, next);
+  else
+  {
+   next->start = e->start + size;
+   next->size -= size - e->size;
+   extent_insert_free(h, next);
+  }
+ }
+ else if (size < e->size)
+ {
+  /* Give back what is not needed, merged with the following block if
+     that one is free. */
+  if (next_free)
+  {
+   extent_remove_free(h, next);
+   next->start = e->start + size;
+   next->size += e->size - size;
+   extent_insert_free(h, next);
+  }
+  else
+  {
+   struct extent* const rest = extent_create(e->start + size, e->size - size);
+
+   /* Without memory for the rest the block just stays as large as it
+      was. */
+   if (0 == rest)
+    return 1;
+
+   extent_link_after(h, e, rest);
+   extent_insert_free(h, rest);
+  }
+ }
+
+ h->used += size - e->size;
+ e->size = size;
+ return 1;
+}
+
+size_t extent_heap_usable_size(const struct extent_heap* const h,
+                               const void* const ptr)
+{
+ const struct extent* const e = extent_lookup(h, (uintptr_t) ptr, 0);
+
+ return (0 != e) ? e->size : 0;
+}
+
+int extent_heap_is_used(struct extent_heap* const h, const uintptr_t start,
+                        const uintptr_t end)
+{
+ struct extent* e = (0 != h->last_found) ? h->last_found : h->first;
+
+ if (0 == e)
+  return 0;
+
+ /* Step back to the last block starting at or below start, then look at
+    the blocks up to end. */
+ while ((0 != e->previous) && (e->start > start))
+  e = e->previous;
+
+ for (; (0 != e) && (e->start < end); e = e->next)
+ {
+  if (e->start <= start)
+   h->last_found = e;
+  if (e->used && (e->start + e->size > start))
+   return 1;
+ }
+
+ return 0;
+}
+
+void extent_heap_report(const struct extent_heap* const h,
+                        struct heap_statistics* const statistics)
+{
+ int class;
+
+ statistics->used_bytes = h->used;
+ statistics->largest_free_block = 0;
+
+ for (class = 0; class < HEAP_CLASSES; class++)
+ {
+  const struct extent* e;
+
+  statistics->free_bytes[class] = 0;
+  for (e = h->free_lists[class]; 0 != e; e = e->link_next)
+  {
+   statistics->free_bytes[class] += e->size;
+   if (e->size > statistics->largest_free_block)
+    statistics->largest_free_block = e->size;
+  }
+ }
 }
@@ -24,9 +24,257 @@ void* embedded_malloc(size_t size);
  */
 void embedded_free(void *ptr);
 
+/**
+ * @name    embedded_is_allocated
+ * @brief   Returns non-zero if ptr was returned by embedded_malloc and has not been freed since.
+ */
+int embedded_is_allocated(const void *ptr);
+
+/** Size of a page frame in bytes. */
+#define FRAME_SIZE      (4096)
+
+/** Largest order handed out by frame_allocate. A block of order k is 2^k frames long. */
+#define FRAME_MAX_ORDER (10)
+
+/**
+ * @name    frame_add_memory
+ * @brief   Hands the whole frames in [start, end) to the page frame allocator. Must be called after initialize.
+ */
+void frame_add_memory(uintptr_t start, uintptr_t end);
+
+/**
+ * @name    frame_allocate
+ * @brief   Allocates 2^order contiguous page frames aligned to their size. Returns the address of the first frame or 0.
+ */
+void* frame_allocate(unsigned int order);
+
+/**
+ * @name    frame_free
+ * @brief   Frees frames previously allocated by frame_allocate with the same order.
+ */
+void frame_free(void* frames, unsigned int order);
+
+/**
+ * @name    frame_share
+ * @brief   Adds a reference to a single frame allocated by frame_allocate.
+ */
+void frame_share(void* frame);
+
+/**
+ * @name    frame_is_shared
+ * @brief   Returns non-zero if a frame has more than one reference.
+ */
+int frame_is_shared(const void* frame);
+
+/**
+ * @name    frame_release
+ * @brief   Drops a reference to a single frame. The frame is freed when the last reference is dropped.
+ */
+void frame_release(void* frame);
+
+/** Number of size classes in a heap. Class i holds free blocks of size [2^i, 2^(i+1)). */
+#define HEAP_CLASSES    (32)
+
+struct block;
+
+/** Defines a heap. A heap is a segregated-fit allocator over memory handed to it with heap_add_region. */
+struct heap
+{
+ uint32_t      class_bitmap;             /**< Bit i is set when free_lists[i] is not empty. */
+ struct block* free_lists[HEAP_CLASSES]; /**< Free blocks per size class. */
+ uintptr_t     start;                    /**< Lowest address managed by the heap. */
+ uintptr_t     end;                      /**< Address of the highest end sentinel. */
+ uintptr_t     key;                      /**< Mixed into the magic of used blocks. Set to the address of the heap by heap_init and kept when the heap is copied. */
+ size_t        used;                     /**< Bytes in blocks handed out by heap_allocate, headers included. */
+};
+
+/** Describes the state of a heap. */
+struct heap_statistics
+{
+ size_t used_bytes;               /**< Bytes in blocks handed out, headers included for a struct heap. */
+ size_t free_bytes[HEAP_CLASSES]; /**< Bytes in the free blocks of each size class. */
+ size_t largest_free_block;       /**< Size of the largest free block in bytes. */
+};
+
+/**
+ * @name    heap_init
+ * @brief   Sets up an empty heap.
+ */
+void heap_init(struct heap* h);
+
+/**
+ * @name    heap_add_region
+ * @brief   Hands the memory [start, end) to a heap. The memory is merged with the heap when it is adjacent to it.
+ */
+void heap_add_region(struct heap* h, uintptr_t start, uintptr_t end);
+
+/**
+ * @name    heap_allocate
+ * @brief   Allocates at least size contiguous bytes from a heap. Returns 0 if the heap has no block that large.
+ */
+void* heap_allocate(struct heap* h, size_t size);
+
+/**
+ * @name    heap_free
+ * @brief   Frees a block allocated from the same heap. Returns zero if ptr was not handed out by the heap.
+ */
+int heap_free(struct heap* h, void* ptr);
+
+/**
+ * @name    heap_allocate_aligned
+ * @brief   Like heap_allocate, but the returned address is a multiple of alignment, which must be a power of two. Returns 0 if no block fits or alignment is not a power of two.
+ */
+void* heap_allocate_aligned(struct heap* h, size_t length, size_t alignment);
+
+/**
+ * @name    heap_resize
+ * @brief   Resizes a block allocated from a heap without moving it, growing into the following block if that one is free. Returns zero, leaving the block unchanged, if ptr was not handed out by the heap or the block can not grow in place.
+ */
+int heap_resize(struct heap* h, void* ptr, size_t length);
+
+/**
+ * @name    heap_report
+ * @brief   Fills in statistics on a heap by walking its free lists.
+ */
+void heap_report(const struct heap* h, struct heap_statistics* statistics);
+
+/**
+ * @name    heap_usable_size
+ * @brief   Returns the number of bytes that can be used in a block allocated from a heap, or zero if ptr was not handed out by the heap.
+ */
+size_t heap_usable_size(const struct heap* h, const void* ptr);
+
+struct extent;
+
+/** Defines a heap whose bookkeeping is kept in kernel memory, apart from the memory it manages. The managed memory is never read or written, so it can be memory a process can write, such as its heap. Blocks are looked up by the address handed out. Allocation takes a bit scan over the size classes, as for struct heap. */
+struct extent_heap
+{
+ uint32_t        class_bitmap;             /**< Bit i is set when free_lists[i] is not empty. */
+ struct extent*  free_lists[HEAP_CLASSES]; /**< Free blocks per size class. */
+ struct extent** buckets;                  /**< Used blocks hashed on their address. Allocated with embedded_malloc. */
+ uint32_t        bucket_count;             /**< Number of entries in buckets. A power of two, or 0 before the first allocation. */
+ uint32_t        used_blocks;              /**< Number of blocks handed out. */
+ size_t          used;                     /**< Bytes in blocks handed out. */
+ struct extent*  first;                    /**< The block at the lowest address. All blocks are linked in address order from it. */
+ struct extent*  last_found;               /**< The block extent_heap_is_used stopped at, or 0. The next call walks the address order from it. */
+};
+
+/**
+ * @name    extent_heap_init
+ * @brief   Sets up an empty extent heap.
+ */
+void extent_heap_init(struct extent_heap* h);
+
+/**
+ * @name    extent_heap_destroy
+ * @brief   Releases the bookkeeping of an extent heap and leaves it empty.
+ */
+void extent_heap_destroy(struct extent_heap* h);
+
+/**
+ * @name    extent_heap_clone
+ * @brief   Sets up copy as a copy of the extent heap h, with the same blocks used and free. Returns zero, leaving copy empty, if memory is exhausted.
+ */
+int extent_heap_clone(struct extent_heap* copy, const struct extent_heap* h);
+
+/**
+ * @name    extent_heap_add_region
+ * @brief   Hands the memory [start, end) to an extent heap. It must not overlap memory already in the heap, and is merged with adjacent free blocks. Returns zero if memory for the bookkeeping is exhausted.
+ */
+int extent_heap_add_region(struct extent_heap* h, uintptr_t start, uintptr_t end);
+
+/**
+ * @name    extent_heap_allocate
+ * @brief   Allocates at least size contiguous bytes from an extent heap, at a multiple of alignment if it is not 0. Returns 0 if no block fits, alignment is not a power of two or memory for the bookkeeping is exhausted.
+ */
+void* extent_heap_allocate(struct extent_heap* h, size_t size, size_t alignment);
+
+/**
+ * @name    extent_heap_free
+ * @brief   Frees a block allocated from the same extent heap. Returns zero if ptr was not handed out by the heap.
+ */
+int extent_heap_free(struct extent_heap* h, void* ptr);
+
+/**
+ * @name    extent_heap_resize
+ * @brief   Resizes a block allocated from an extent heap without moving it, growing into the following block if that one is free. Returns zero, leaving the block unchanged, if ptr was not handed out by the heap or the block can not grow in place.
+ */
+int extent_heap_resize(struct extent_heap* h, void* ptr, size_t length);
+
+/**
+ * @name    extent_heap_usable_size
+ * @brief   Returns the size of a block allocated from an extent heap, or zero if ptr was not handed out by the heap.
+ */
+size_t extent_heap_usable_size(const struct extent_heap* h, const void* ptr);
+
+/**
+ * @name    extent_heap_is_used
+ * @brief   Returns nonzero if a block allocated from an extent heap overlaps [start, end). Takes time in the number of blocks between the range and the one looked at last, so ranges looked up in address order are cheap.
+ */
+int extent_heap_is_used(struct extent_heap* h, uintptr_t start, uintptr_t end);
+
+/**
+ * @name    extent_heap_report
+ * @brief   Fills in statistics on an extent heap by walking its free lists.
+ */
+void extent_heap_report(const struct extent_heap* h, struct heap_statistics* statistics);
+
+/** Size of a cache line in bytes. Objects from object caches are aligned to it. */
+#define CACHE_LINE_SIZE (64)
+
+struct slab;
+
+/** Defines a cache of equally sized objects. Objects are carved from slabs of page frames. */
+struct object_cache
+{
+ const char*          name;             /**< Name used when reporting statistics. */
+ size_t               object_size;      /**< Size of each object, rounded up to CACHE_LINE_SIZE. */
+ unsigned int         order;            /**< Order of the frame blocks used for slabs. */
+ size_t               objects_per_slab; /**< Number of objects in each slab. */
+ struct slab*         partial_slabs;    /**< Slabs with both free and used objects. */
+ struct slab*         full_slabs;       /**< Slabs without free objects. */
+ struct slab*         empty_slab;       /**< A slab without used objects kept for reuse, or 0. */
+ size_t               active_objects;   /**< Number of objects handed out. */
+ size_t               slabs;            /**< Number of slabs owned by the cache. */
+ struct object_cache* next;             /**< Next cache in the list of all caches. */
+};
+
+/** Statistics for one object cache. */
+struct object_cache_statistics
+{
+ const char* name;           /**< Name of the cache. */
+ size_t      active_objects; /**< Number of objects handed out. */
+ size_t      slabs;          /**< Number of slabs owned by the cache. */
+ size_t      bytes;          /**< Number of bytes of frames owned by the cache. */
+};
+
+/**
+ * @name    object_cache_init
+ * @brief   Sets up an empty cache for objects of object_size bytes.
+ */
+void object_cache_init(struct object_cache* cache, const char* name, size_t object_size);
+
+/**
+ * @name    object_cache_allocate
+ * @brief   Returns a cache line aligned object from the cache or 0 if memory is exhausted.
+ */
+void* object_cache_allocate(struct object_cache* cache);
+
+/**
+ * @name    object_cache_free
+ * @brief   Returns an object to the cache it was allocated from.
+ */
+void object_cache_free(struct object_cache* cache, void* object);
+
+/**
+ * @name    object_cache_report
+ * @brief   Calls hook once for every object cache with its current statistics.
+ */
+void object_cache_report(void (*hook)(const struct object_cache_statistics*));
+
 /**
  * @name    initialize
- * @brief   Initializes the memory system.
+ * @brief   Initializes the memory system. Places the frame bitmap and the frame share counts at lowest_available_physical_memory and moves it past them. No memory is available until it is handed over with frame_add_memory.
  */
 void initialize();
 
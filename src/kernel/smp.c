@@ -0,0 +1,385 @@
+/* Copyright (c) 1997-2016, FenixOS Developers
+   All Rights Reserved.
+
+   This file is subject to the terms and conditions defined in
+   file 'LICENSE', which is part of this source code package.
+ */
+
+/*! \file smp.c This file holds the code that sets up each cpu, starts the
+   application processors and drives the local APICs.
+
+   Each cpu has its own global descriptor table. Next to the usual
+   segments it holds a task state segment pointing to the kernel stack of
+   the cpu, and a data segment whose base is the struct cpu of the cpu. The
+   kernel keeps fs loaded with the latter, so the state of the current cpu
+   is found through fs without knowing which cpu it is.
+
+   The kernel is serialized by a single lock. It is taken on every entry
+   from user space and released by go_to_user_space, so threads only run
+   in parallel in user space. */
+
+#include <stdint.h>
+#include <instruction_wrappers.h>
+
+#include "mm.h"
+#include "vm.h"
+#include "timer.h"
+#include "smp.h"
+
+/* Declarations for symbols found in the assembly code. */
+
+/*! Entry point into the kernel for system calls via sysenter. */
+extern uint8_t sysenter_entry_point[];
+
+/*! The kernel stack of the boot cpu. */
+extern uint8_t kernel_stack[];
+
+/*! Start of the real mode code the application processors start in. */
+extern uint8_t ap_trampoline[];
+
+/*! End of the real mode code the application processors start in. */
+extern uint8_t ap_trampoline_end[];
+
+/*! Operand of the lgdt instruction in the real mode code. */
+extern uint8_t ap_gdt_pointer[];
+
+/*! Physical address of the local APIC. */
+#define APIC_BASE              (0xfee00000)
+
+/*! Machine specific register holding the address of the local APIC. */
+#define APIC_BASE_MSR          (0x1b)
+
+/*! Enables the local APIC in APIC_BASE_MSR. */
+#define APIC_GLOBAL_ENABLE     (0x800)
+
+/*! Registers of the local APIC, as offsets from APIC_BASE. */
+#define APIC_ID                (0x020)
+#define APIC_TASK_PRIORITY     (0x080)
+#define APIC_END_OF_INTERRUPT  (0x0b0)
+#define APIC_SPURIOUS          (0x0f0)
+#define APIC_COMMAND_LOW       (0x300)
+#define APIC_COMMAND_HIGH      (0x310)
+#define APIC_LVT_TIMER         (0x320)
+#define APIC_LVT_LINT0         (0x350)
+#define APIC_LVT_LINT1         (0x360)
+#define APIC_TIMER_INITIAL     (0x380)
+#define APIC_TIMER_CURRENT     (0x390)
+#define APIC_TIMER_DIVIDE      (0x3e0)
+
+/*! Enables the local APIC in APIC_SPURIOUS. */
+#define APIC_SOFTWARE_ENABLE   (0x100)
+
+/*! Set in APIC_COMMAND_LOW while an interprocessor interrupt is sent. */
+#define APIC_DELIVERY_PENDING  (0x1000)
+
+/*! Interprocessor interrupts sent to all cpus but the sender. */
+#define IPI_INIT               (0x000c4500)
+#define IPI_STARTUP            (0x000c4600)
+
+/*! Interprocessor interrupt to one cpu at a vector. */
+#define IPI_FIXED              (0x00004000)
+
+/*! Local vector table settings. */
+#define LVT_MASKED             (0x10000)
+#define LVT_PERIODIC           (0x20000)
+#define LVT_EXTERNAL           (0x700)
+#define LVT_NMI                (0x400)
+
+/*! Makes the APIC timer count at the bus clock. */
+#define TIMER_DIVIDE_BY_1      (0xb)
+
+/*! Physical address the application processors start at. It must be below
+    1 MiB and a multiple of 4 KiB. */
+#define AP_TRAMPOLINE          (0x8000)
+
+/*! Order of the frame block used as kernel stack by each application
+    processor. */
+#define AP_STACK_ORDER         (1)
+
+struct cpu cpus[MAX_CPUS];
+
+volatile uint32_t cpu_count = 1;
+
+uintptr_t cpu_stacks[MAX_CPUS];
+
+/*! The kernel lock. The boot cpu holds it from the start and releases it
+    when it first goes to user space. */
+volatile uint32_t kernel_lock = 1;
+
+/*! Next id handed to a starting application processor. Read by entry.s. */
+volatile uint32_t next_cpu_id = 1;
+
+/*! Number of cpus in use. Ids from this on are left halted. Read by
+    entry.s. */
+const uint32_t smp_max_cpus = MAX_CPUS;
+
+/*! Number of cpus yet to answer a TLB flush. Decremented by entry.s. */
+volatile uint32_t tlb_flush_pending;
+
+/*! Number of APIC timer counts per millisecond. */
+static uint32_t apic_ticks_per_millisecond;
+
+/* Helper functions. */
+
+/*! Returns the value of a local APIC register. */
+static uint32_t
+apic_read(const uint32_t reg)
+{
+ return *(volatile const uint32_t*) (APIC_BASE + reg);
+}
+
+/*! Writes a local APIC register. */
+static void
+apic_write(const uint32_t reg, const uint32_t value)
+{
+ *(volatile uint32_t*) (APIC_BASE + reg) = value;
+}
+
+/*! Sends an interprocessor interrupt and waits for the APIC to accept
+    it. */
+static void
+apic_send(const uint32_t apic_id, const uint32_t command)
+{
+ apic_write(APIC_COMMAND_HIGH, apic_id << 24);
+ apic_write(APIC_COMMAND_LOW, command);
+ while (apic_read(APIC_COMMAND_LOW) & APIC_DELIVERY_PENDING)
+  pause();
+}
+
+/*! Software enables the local APIC of the calling cpu and records its
+    id. */
+static void
+apic_enable(void)
+{
+ apic_write(APIC_SPURIOUS, APIC_SOFTWARE_ENABLE | APIC_SPURIOUS_VECTOR);
+ apic_write(APIC_TASK_PRIORITY, 0);
+ this_cpu()->apic_id = apic_read(APIC_ID) >> 24;
+}
+
+/*! Waits for at least a number of microseconds. */
+static void
+delay(const uint32_t microseconds)
+{
+ const uint32_t cycles = cycles_per_millisecond / 1000 * microseconds;
+ const uint32_t start  = (uint32_t) rdtsc();
+
+ while ((uint32_t) rdtsc() - start < cycles)
+  pause();
+}
+
+/* Definitions. */
+
+void smp_cpu_init(const uint32_t id, const uintptr_t stack)
+{
+ struct cpu* const cpu = &cpus[id];
+
+ cpu->self = cpu;
+ cpu->thread = 0;
+ cpu->process = 0;
+ cpu->id = id;
+ cpu_stacks[id] = stack;
+
+ /* Set up segment selectors. This is a x86 specific concept. Selectors
+    are used to control execution modes of the processor and to control
+    how data is accessed. Selectors are controlled through the GDT. The
+    processor has to be given the size and pointer to the GDT. */
+ {
+  static const uint32_t segments[10] = {0, 0, /* null */
+                                        0xffff, 0x00cf9a00, /* kernel code */
+                                        0xffff, 0x00cf9200, /* kernel data */
+                                        0xffff, 0x00cffa00, /* user code */
+                                        0xffff, 0x00cff200  /* user data */};
+  const uintptr_t tss_base = (uintptr_t) cpu->tss;
+  const uintptr_t cpu_base = (uintptr_t) cpu;
+  int             i;
+
+  for (i = 0; i < 10; i++)
+   cpu->gdt[i] = segments[i];
+
+  /* The addresses of the TSS and of the per-cpu data are not known until
+     run time, so their descriptors are filled in here. */
+  cpu->gdt[10] = (tss_base << 16) | (sizeof(cpu->tss) - 1);
+  cpu->gdt[11] = (tss_base & 0xff000000) | ((tss_base >> 16) & 0xff) |
+                 0x8900;
+  cpu->gdt[12] = (cpu_base << 16) | (sizeof(struct cpu) - 1);
+  cpu->gdt[13] = (cpu_base & 0xff000000) | ((cpu_base >> 16) & 0xff) |
+                 0x409200;
+
+  /* Install it. */
+  lgdt(sizeof(cpu->gdt) - 1, (uintptr_t) cpu->gdt);
+  /* Install the local descriptor table. This is related to the GDT and
+     installed as a safety/stability precaution. */
+  lldt(0);
+
+  /* Make the processor use the new GDT. */
+  __asm volatile ("mov %%bx, %%ds\n \
+                   mov %%bx, %%es\n \
+                   mov %%cx, %%fs\n \
+                   mov %%bx, %%gs\n \
+                   mov %%bx, %%ss\n \
+                   ljmp $8,$1f\n \
+                   1:" : : "b" (16), "c" (PER_CPU_SELECTOR) : "memory");
+
+  /* Interrupts from user space switch to the top of the kernel stack, as
+     sysenter does. The I/O bitmap is placed beyond the end of the TSS, so
+     user space has no access to ports. */
+  for (i = 0; i < 26; i++)
+   cpu->tss[i] = 0;
+  cpu->tss[1] = stack - 4;
+  cpu->tss[2] = 16;
+  cpu->tss[25] = sizeof(cpu->tss) << 16;
+  ltr(40);
+ }
+
+ /* Set up support for sysenter. */
+ /* The base code segment selector. This is used to set the other selectors. */
+ wrmsr(0x174, 8, 0);
+ /* Kernel stack pointer. We keep the top 4 bytes set to zero to keep GDB
+    happy. */
+ wrmsr(0x175, stack - 4, 0);
+ /* The entry point for sysenter. We will end up there at system calls. */
+ wrmsr(0x176, (uintptr_t) sysenter_entry_point, 0);
+}
+
+void smp_init(void)
+{
+ uint32_t eax, ebx, ecx, edx;
+ uint32_t i;
+
+ cpuid(1, &eax, &ebx, &ecx, &edx);
+ if (!(0x200 & edx))
+  return;
+
+ /* Place the local APIC at its default address, which the kernel maps
+    uncached into every address space. */
+ rdmsr(APIC_BASE_MSR, &eax, &edx);
+ wrmsr(APIC_BASE_MSR, APIC_BASE | APIC_GLOBAL_ENABLE | (eax & 0xfff), 0);
+ paging_map_device(APIC_BASE);
+
+ /* The interrupt controllers keep reaching the boot cpu through LINT0. */
+ apic_enable();
+ apic_write(APIC_LVT_LINT0, LVT_EXTERNAL);
+ apic_write(APIC_LVT_LINT1, LVT_NMI);
+
+ /* Measure the speed of the APIC timer against the time stamp counter,
+    which timer_init measured against the interval timer. */
+ apic_write(APIC_TIMER_DIVIDE, TIMER_DIVIDE_BY_1);
+ apic_write(APIC_LVT_TIMER, LVT_MASKED | APIC_TIMER_VECTOR);
+ apic_write(APIC_TIMER_INITIAL, 0xffffffff);
+ delay(10000);
+ apic_ticks_per_millisecond =
+  (0xffffffff - apic_read(APIC_TIMER_CURRENT)) / 10;
+ apic_write(APIC_TIMER_INITIAL, 0);
+
+ /* Give each application processor a kernel stack. A processor without
+    one is left halted. */
+ for (i = 1; i < MAX_CPUS; i++)
+ {
+  uint8_t* const stack = frame_allocate(AP_STACK_ORDER);
+
+  cpu_stacks[i] = (0 != stack) ?
+                  (uintptr_t) stack + (FRAME_SIZE << AP_STACK_ORDER) : 0;
+ }
+
+ /* Copy the code the processors start in to where they start, and point
+    it to the descriptor table of the boot cpu, which holds flat code and
+    data segments. */
+ {
+  uint8_t* const trampoline = (uint8_t*) AP_TRAMPOLINE;
+  uint8_t* const gdt_pointer = trampoline + (ap_gdt_pointer - ap_trampoline);
+  const uintptr_t gdt = (uintptr_t) cpus[0].gdt;
+  uint32_t       j;
+
+  for (j = 0; j < ap_trampoline_end - ap_trampoline; j++)
+   trampoline[j] = ap_trampoline[j];
+
+  gdt_pointer[0] = (sizeof(cpus[0].gdt) - 1) & 0xff;
+  gdt_pointer[1] = (sizeof(cpus[0].gdt) - 1) >> 8;
+  for (j = 0; j < 4; j++)
+   gdt_pointer[2 + j] = (gdt >> (8 * j)) & 0xff;
+ }
+
+ /* Wake the other processors as the Intel MultiProcessor Specification
+    describes. */
+ apic_send(0, IPI_INIT);
+ delay(10000);
+ apic_send(0, IPI_STARTUP | (AP_TRAMPOLINE >> 12));
+ delay(200);
+ apic_send(0, IPI_STARTUP | (AP_TRAMPOLINE >> 12));
+
+ /* Wait for the processors that answered to finish setting up. */
+ delay(10000);
+ for (;;)
+ {
+  const uint32_t started = (next_cpu_id < MAX_CPUS) ? next_cpu_id : MAX_CPUS;
+  uint32_t       stacks  = 1;
+
+  for (i = 1; i < started; i++)
+   if (0 != cpu_stacks[i])
+    stacks++;
+
+  if (cpu_count >= stacks)
+   break;
+  pause();
+ }
+}
+
+void smp_start_timer(const uint32_t frequency)
+{
+ apic_enable();
+
+ apic_write(APIC_TIMER_DIVIDE, TIMER_DIVIDE_BY_1);
+ apic_write(APIC_LVT_TIMER, LVT_PERIODIC | APIC_TIMER_VECTOR);
+ apic_write(APIC_TIMER_INITIAL,
+            apic_ticks_per_millisecond / frequency * 1000 +
+            apic_ticks_per_millisecond % frequency * 1000 / frequency);
+
+ lock_xadd(&cpu_count, 1);
+}
+
+void apic_acknowledge(void)
+{
+ apic_write(APIC_END_OF_INTERRUPT, 0);
+}
+
+void smp_flush_tlbs(uint32_t mask)
+{
+ uint32_t count = 0;
+ uint32_t i;
+
+ mask &= ~(1U << this_cpu()->id);
+ if (0 == mask)
+  return;
+
+ for (i = 0; i < MAX_CPUS; i++)
+  if (mask & (1U << i))
+   count++;
+
+ tlb_flush_pending = count;
+
+ for (i = 0; i < MAX_CPUS; i++)
+  if (mask & (1U << i))
+   apic_send(cpus[i].apic_id, IPI_FIXED | TLB_FLUSH_VECTOR);
+
+ /* The other cpus are in user space, idle or waiting for the kernel lock
+    with interrupts enabled, so they all get to answer. */
+ while (0 != tlb_flush_pending)
+  pause();
+}
+
+void kernel_lock_acquire(void)
+{
+ while (0 != lock_xchg(&kernel_lock, 1))
+ {
+  sti();
+  while (0 != kernel_lock)
+   pause();
+  cli();
+ }
+}
+
+void kernel_lock_release(void)
+{
+ __asm volatile("" : : : "memory");
+ kernel_lock = 0;
+}
@@ -0,0 +1,108 @@
+/* Copyright (c) 1997-2016, FenixOS Developers
+   All Rights Reserved.
+
+   This file is subject to the terms and conditions defined in
+   file 'LICENSE', which is part of this source code package.
+ */
+
+/*! \file smp.h Per-cpu state, the kernel lock and the local APIC. */
+
+#ifndef _SMP_H_
+#define _SMP_H_
+
+#include <stdint.h>
+
+/** Largest number of cpus the kernel uses. Further cpus are left halted. */
+#define MAX_CPUS             (8)
+
+/** Selector of the segment fs points to in the kernel. Its base is the struct cpu of the cpu. */
+#define PER_CPU_SELECTOR     (48)
+
+/** Interrupt vector of the timer of the local APIC. */
+#define APIC_TIMER_VECTOR    (48)
+
+/** Interrupt vector of the interprocessor interrupt that flushes the TLB. */
+#define TLB_FLUSH_VECTOR     (49)
+
+/** Interrupt vector the local APIC uses for spurious interrupts. */
+#define APIC_SPURIOUS_VECTOR (255)
+
+struct thread;
+struct process;
+
+/** Defines the state kept for each cpu. */
+struct cpu
+{
+ struct cpu*     self;    /**< Points to the structure itself, so it can be found through fs. */
+ struct thread*  thread;  /**< The thread running on the cpu. The entry code in entry.s reads it at offset 4. */
+ struct process* process; /**< The process the thread belongs to. */
+ /* The above members must be the first in the struct. Do not change the order. */
+ uint32_t        id;      /**< Index of the cpu in cpus. The cpu the kernel booted on is 0. */
+ uint32_t        apic_id; /**< Identifier of the local APIC of the cpu. */
+ struct thread*  fpu_owner; /**< The thread whose FPU and SSE state is in the registers of the cpu, or 0. */
+ volatile uint32_t idle;  /**< Set while the cpu waits for a thread to run. Clearing it wakes a cpu waiting in mwait. */
+ uint32_t        gdt[14]; /**< Global descriptor table of the cpu. */
+ uint32_t        tss[26]; /**< Task state segment of the cpu. */
+};
+
+/** The cpus, indexed by id. */
+extern struct cpu cpus[MAX_CPUS];
+
+/** Number of cpus running the kernel. */
+extern volatile uint32_t cpu_count;
+
+/** Top of the kernel stack of each cpu. */
+extern uintptr_t cpu_stacks[MAX_CPUS];
+
+/** Returns the state of the cpu the caller runs on. */
+static inline struct cpu*
+this_cpu(void)
+{
+ struct cpu* cpu;
+ __asm volatile("mov %%fs:0,%0" : "=r" (cpu));
+ return cpu;
+}
+
+/**
+ * @name    smp_cpu_init
+ * @brief   Gives the calling cpu its own global descriptor table, task state segment, per-cpu segment in fs and sysenter stack. stack is the top of the kernel stack of the cpu.
+ */
+void smp_cpu_init(uint32_t id, uintptr_t stack);
+
+/**
+ * @name    smp_init
+ * @brief   Enables the local APIC of the boot cpu and starts the other cpus through the INIT-SIPI-SIPI sequence. Started cpus call ap_init with their id. Does nothing if the processor has no local APIC. Must be called after timer_init, and before the first address space is created as the APIC is mapped into the kernel mappings.
+ */
+void smp_init(void);
+
+/**
+ * @name    smp_start_timer
+ * @brief   Enables the local APIC of the calling cpu and starts its timer at frequency interrupts per second on APIC_TIMER_VECTOR. Counts the cpu as running.
+ */
+void smp_start_timer(uint32_t frequency);
+
+/**
+ * @name    apic_acknowledge
+ * @brief   Tells the local APIC that an interrupt has been handled.
+ */
+void apic_acknowledge(void);
+
+/**
+ * @name    smp_flush_tlbs
+ * @brief   Flushes the TLB of all cpus in the bit mask cpus, other than the calling one, and waits for them to do so. The caller must hold the kernel lock.
+ */
+void smp_flush_tlbs(uint32_t cpus);
+
+/**
+ * @name    kernel_lock_acquire
+ * @brief   Waits for and takes the lock serializing the kernel. Interrupts are enabled while waiting, so the cpu keeps answering TLB flushes.
+ */
+void kernel_lock_acquire(void);
+
+/**
+ * @name    kernel_lock_release
+ * @brief   Releases the kernel lock. go_to_user_space releases it on its own.
+ */
+void kernel_lock_release(void);
+
+#endif
@@ -0,0 +1,204 @@
+/* Copyright (c) 1997-2016, FenixOS Developers
+   All Rights Reserved.
+
+   This file is subject to the terms and conditions defined in
+   file 'LICENSE', which is part of this source code package.
+ */
+
+/*! \file timer.c This file holds the code driving the programmable interval
+   timer and the interrupt controllers. */
+
+#include <stdint.h>
+#include <instruction_wrappers.h>
+
+#include "timer.h"
+
+#ifdef BENCHMARK
+/*! Outputs a string to the VGA screen. */
+extern void
+kprints(const char* const string);
+
+/*! Outputs an unsigned 32-bit value to the VGA screen. */
+extern void
+kprinthex(const register uint32_t value);
+#endif
+
+/*! Command port of the master interrupt controller. */
+#define PIC_MASTER_COMMAND     (0x20)
+
+/*! Data port of the master interrupt controller. */
+#define PIC_MASTER_DATA        (0x21)
+
+/*! Command port of the slave interrupt controller. */
+#define PIC_SLAVE_COMMAND      (0xa0)
+
+/*! Data port of the slave interrupt controller. */
+#define PIC_SLAVE_DATA         (0xa1)
+
+/*! Tells an interrupt controller that an interrupt has been handled. */
+#define PIC_END_OF_INTERRUPT   (0x20)
+
+/*! Data port of channel 0 of the interval timer. */
+#define PIT_CHANNEL_0          (0x40)
+
+/*! Command port of the interval timer. */
+#define PIT_COMMAND            (0x43)
+
+/*! Channel 0, low then high byte of the count, rate generator. */
+#define PIT_RATE_GENERATOR     (0x34)
+
+/*! Channel 0, latch the count. */
+#define PIT_LATCH              (0x00)
+
+/*! Frequency of the input clock of the interval timer in Hz. */
+#define PIT_FREQUENCY          (1193182)
+
+/*! Count giving 10 ms periods, used to measure the time stamp counter. */
+#define CALIBRATION_COUNT      (11932)
+
+volatile uint32_t timer_ticks;
+
+uint32_t cycles_per_millisecond;
+
+/* Helper functions. */
+
+/*! Loads channel 0 of the interval timer with a count. */
+static void
+load_count(const uint32_t count)
+{
+ outb(PIT_COMMAND, PIT_RATE_GENERATOR);
+ outb(PIT_CHANNEL_0, count & 0xff);
+ outb(PIT_CHANNEL_0, (count >> 8) & 0xff);
+}
+
+/*! Returns the current count of channel 0 of the interval timer. */
+static uint32_t
+read_count(void)
+{
+ uint32_t low;
+
+ outb(PIT_COMMAND, PIT_LATCH);
+ low = (uint8_t) inInt8(PIT_CHANNEL_0);
+ return low | ((uint32_t) (uint8_t) inInt8(PIT_CHANNEL_0) << 8);
+}
+
+/*! Waits until channel 0 of the interval timer starts a new period. */
+static void
+wait_for_period(void)
+{
+ uint32_t previous = read_count();
+ uint32_t current;
+
+ /* The count goes down and jumps back up when a period starts. */
+ while ((current = read_count()) <= previous)
+  previous = current;
+}
+
+/* Definitions. */
+
+void timer_init(const uint32_t frequency)
+{
+ /* Move the interrupts of the interrupt controllers away from the
+    exceptions of the processor, to vectors TIMER_VECTOR to
+    TIMER_VECTOR + 15. */
+ outb(PIC_MASTER_COMMAND, 0x11);
+ outb(PIC_SLAVE_COMMAND, 0x11);
+ outb(PIC_MASTER_DATA, TIMER_VECTOR);
+ outb(PIC_SLAVE_DATA, TIMER_VECTOR + 8);
+ outb(PIC_MASTER_DATA, 4);
+ outb(PIC_SLAVE_DATA, 2);
+ outb(PIC_MASTER_DATA, 1);
+ outb(PIC_SLAVE_DATA, 1);
+
+ /* Only the timer is used. */
+ outb(PIC_MASTER_DATA, (int8_t) 0xfe);
+ outb(PIC_SLAVE_DATA, (int8_t) 0xff);
+
+ /* Count time stamp counter cycles over one 10 ms period. The interrupt
+    is masked by the processor, so the count can be polled. */
+ load_count(CALIBRATION_COUNT);
+ wait_for_period();
+ {
+  const uint32_t start = (uint32_t) rdtsc();
+
+  wait_for_period();
+  cycles_per_millisecond = ((uint32_t) rdtsc() - start) / 10;
+ }
+
+ timer_set_frequency(frequency);
+}
+
+void timer_set_frequency(const uint32_t frequency)
+{
+ uint32_t count = PIT_FREQUENCY / frequency;
+
+ if (count > 0xffff)
+  count = 0xffff;
+ if (count < 1)
+  count = 1;
+
+ load_count(count);
+}
+
+void timer_acknowledge(void)
+{
+ timer_ticks++;
+ outb(PIC_MASTER_COMMAND, PIC_END_OF_INTERRUPT);
+}
+
+#ifdef BENCHMARK
+
+/*! Number of iterations of the work measured with and without timer
+    interrupts. */
+#define BENCHMARK_ITERATIONS   (1000000)
+
+/*! Does a fixed amount of work with interrupts enabled if interrupts is
+    set. Returns the number of cycles it took. */
+static uint32_t
+measure_work(const int interrupts)
+{
+ volatile uint32_t counter = 0;
+ uint32_t          start;
+ uint32_t          i;
+
+ if (interrupts)
+  sti();
+ start = (uint32_t) rdtsc();
+ for (i = 0; i < BENCHMARK_ITERATIONS; i++)
+  counter++;
+ start = (uint32_t) rdtsc() - start;
+ cli();
+
+ return start;
+}
+
+void timer_benchmark(const uint32_t frequency)
+{
+ static const uint32_t frequencies[] = {100, 1000, 4000, 10000};
+ const uint32_t        baseline = measure_work(0);
+ int                   i;
+
+ kprints("Cycles per millisecond: ");
+ kprinthex(cycles_per_millisecond);
+
+ /* The difference is the time spent taking timer interrupts. The kernel
+    is interrupted on the short path in entry.s, which only counts the tick,
+    so this is the cost of taking the interrupt rather than of scheduling. */
+ for (i = 0; i < sizeof(frequencies) / sizeof(frequencies[0]); i++)
+ {
+  const uint32_t ticks = timer_ticks;
+  uint32_t       cycles;
+
+  timer_set_frequency(frequencies[i]);
+  cycles = measure_work(1);
+
+  kprints("Cycles per timer tick at frequency ");
+  kprinthex(frequencies[i]);
+  kprinthex(((timer_ticks != ticks) && (cycles > baseline)) ?
+            (cycles - baseline) / (timer_ticks - ticks) : 0);
+ }
+
+ timer_set_frequency(frequency);
+}
+
+#endif
@@ -0,0 +1,53 @@
+/* Copyright (c) 1997-2016, FenixOS Developers
+   All Rights Reserved.
+
+   This file is subject to the terms and conditions defined in
+   file 'LICENSE', which is part of this source code package.
+ */
+
+/*! \file timer.h The periodic timer interrupt. */
+
+#ifndef _TIMER_H_
+#define _TIMER_H_
+
+#include <stdint.h>
+
+/** Interrupt vector of the timer interrupt. */
+#define TIMER_VECTOR        (32)
+
+/** Interrupt vector the interrupt controller uses for spurious interrupts. */
+#define SPURIOUS_VECTOR     (39)
+
+/** Number of timer interrupts since the timer was started. */
+extern volatile uint32_t timer_ticks;
+
+/** Number of time stamp counter cycles per millisecond, measured by timer_init. */
+extern uint32_t cycles_per_millisecond;
+
+/**
+ * @name    timer_init
+ * @brief   Moves the interrupts of the interrupt controller to TIMER_VECTOR and up, masks all but the timer, measures the speed of the time stamp counter and starts the timer at frequency interrupts per second. Interrupts must be disabled.
+ */
+void timer_init(uint32_t frequency);
+
+/**
+ * @name    timer_set_frequency
+ * @brief   Changes the number of timer interrupts per second. The timer runs at no less than 19 interrupts per second.
+ */
+void timer_set_frequency(uint32_t frequency);
+
+/**
+ * @name    timer_acknowledge
+ * @brief   Counts a timer interrupt and tells the interrupt controller it has been handled.
+ */
+void timer_acknowledge(void);
+
+#ifdef BENCHMARK
+/**
+ * @name    timer_benchmark
+ * @brief   Measures the cost of a timer interrupt at several frequencies and prints the result. Leaves the timer at frequency interrupts per second.
+ */
+void timer_benchmark(uint32_t frequency);
+#endif
+
+#endif
@@ -89,27 +89,13 @@ void WriteCharacter(unsigned char c, unsigned char forecolour, unsigned char bac
 }
 
 void
-kprinthex(const register uint32_t *value)
+kprinthex(const register uint32_t value)
 {
-	
-	
-	/*
-	unsigned char buf[4];
- 
-	 pack into buf string 
-	buf[0] = value >> 24;
-	buf[1] = value >> 16;
-	buf[2] = value >> 8;
-	buf[3] = value;
-	 */
-	
-	int x;	
-	for(x = 0; x < 4; x++) {
-		WriteCharacter('x', textColor, backgroundColor,xPosition,yPosition);		
+	int x;
+	for(x = 28; x >= 0; x -= 4) {
+		WriteCharacter("0123456789abcdef"[(value >> x) & 0xf], textColor, backgroundColor,xPosition,yPosition);
 		xPosition++;
 	}
 	yPosition++;
 	xPosition = 0;
-	
-	
 }
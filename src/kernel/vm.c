@@ -0,0 +1,843 @@
+/* Copyright (c) 1997-2016, FenixOS Developers
+   All Rights Reserved.
+
+   This file is subject to the terms and conditions defined in
+   file 'LICENSE', which is part of this source code package.
+ */
+
+/*! \file vm.c This file holds the implementation of paging and of the
+   address spaces of processes. */
+
+#include <stdint.h>
+#include <instruction_wrappers.h>
+
+#include "mm.h"
+#include "vm.h"
+#include "smp.h"
+
+/* Every address space shares the kernel mappings. Physical memory below
+   USER_HEAP_START is identity mapped so the kernel can reach page tables,
+   frames and control blocks without mapping them first. All of it except
+   the first 4 MiB is mapped with 4 MiB pages, and all kernel mappings are
+   global, so switching address spaces does not throw away the TLB entries
+   the kernel needs.
+
+   The first 4 MiB also hold the embedded applications. They are mapped
+   through a page table of 4 KiB pages that each address space has its own
+   copy of. The heap of a process lives in [USER_HEAP_START, USER_HEAP_END)
+   and is mapped with page tables private to the address space. Heap pages
+   are mapped on demand, the first touch of a page causes a page fault that
+   maps a zeroed frame. Memory shared between processes is mapped in
+   [USER_SHARED_START, USER_SHARED_END), at the same address in all the
+   address spaces sharing it, and is not copied on write after a clone.
+
+   Threads of a process may run on several cpus at once. When a mapping is
+   removed or made read-only, the TLBs of the other cpus that have the
+   address space loaded are flushed before the frame can be reused. */
+
+/* Declarations for symbols found in the assembly code or the linker
+   script. */
+
+/*! Halts the machine. */
+extern void halt_the_machine(void);
+
+/*! Location of the first embedded executable application. */
+extern uint8_t exec_0_start[];
+
+/*! Points to after the last byte used by the embedded
+    executable applications. */
+extern uint8_t end_of_applications[];
+
+#ifdef BENCHMARK
+/*! Outputs a string to the VGA screen. */
+extern void
+kprints(const char* const string);
+
+/*! Outputs an unsigned 32-bit value to the VGA screen. */
+extern void
+kprinthex(const register uint32_t value);
+
+/*! Points to the first byte of the kernel image. */
+extern uint8_t start_of_kernel[];
+#endif
+
+/*! Enables paging. */
+#define CR0_PG                 (0x80000000)
+
+/*! Makes read-only pages read-only to the kernel as well. */
+#define CR0_WP                 (0x00010000)
+
+/*! Enables 4 MiB pages. */
+#define CR4_PSE                (0x00000010)
+
+/*! Enables global pages. */
+#define CR4_PGE                (0x00000080)
+
+/*! Number of entries in a page directory or a page table. */
+#define TABLE_ENTRIES          (1024)
+
+/*! Mask used to extract the frame address from an entry. */
+#define ENTRY_ADDRESS_MASK     (~(uint32_t) (PAGE_SIZE - 1))
+
+/*! Blocks of at least this many bytes are backed by frames when they are
+    first touched. Smaller blocks are backed right away, as they are likely
+    to be used soon and a page fault costs more than mapping a page. */
+#define ARENA_LAZY_THRESHOLD   (16 * PAGE_SIZE)
+
+/*! The page fault was caused by a page protection violation rather than by
+    a page that is not present. */
+#define FAULT_PROTECTION       (0x1)
+
+/*! The page fault was caused by a write. */
+#define FAULT_WRITE            (0x2)
+
+/*! The page directory holding the kernel mappings. Address spaces start out
+    as copies of it. */
+static uint32_t* kernel_page_directory;
+
+/*! PAGE_GLOBAL if the processor supports global pages, otherwise 0. */
+static uint32_t global_flag;
+
+/*! The address space each cpu has loaded, or 0 for the kernel page
+    tables. */
+static struct address_space* loaded_address_spaces[MAX_CPUS];
+
+/*! Cache holding all address spaces. */
+static struct object_cache address_space_cache;
+
+/* Helper functions. */
+
+/*! Returns non-zero if the calling cpu has address_space loaded. */
+static int
+is_loaded(const struct address_space* const address_space)
+{
+ return read_cr3() == (uintptr_t) address_space->page_directory;
+}
+
+/*! Returns a zeroed frame for use as a page directory or page table, or 0
+    if memory is exhausted. */
+static uint32_t*
+allocate_table(void)
+{
+ uint32_t* const table = frame_allocate(0);
+ int             i;
+
+ if (0 != table)
+  for (i = 0; i < TABLE_ENTRIES; i++)
+   table[i] = 0;
+
+ return table;
+}
+
+/*! Returns the page table entry for virtual_address. If create is set,
+    a missing page table is allocated. Returns 0 if there is no page table,
+    or if the address is covered by a 4 MiB page. */
+static uint32_t*
+page_entry(struct address_space* const address_space,
+           const uintptr_t virtual_address, const int create)
+{
+ uint32_t* const entry = &address_space->page_directory[virtual_address >> 22];
+ uint32_t*       table;
+
+ if (!(*entry & PAGE_PRESENT))
+ {
+  if (!create || (0 == (table = allocate_table())))
+   return 0;
+  *entry = (uintptr_t) table | PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER |
+           PAGE_OWNED;
+ }
+ else if (*entry & PAGE_LARGE)
+  return 0;
+ else
+  table = (uint32_t*) (*entry & ENTRY_ADDRESS_MASK);
+
+ return &table[(virtual_address >> 12) & (TABLE_ENTRIES - 1)];
+}
+
+/*! Maps zeroed frames at all pages in [start, end) that are not mapped
+    yet. Returns zero if memory is exhausted. */
+static int
+commit_range(struct address_space* const address_space,
+             const uintptr_t start, const uintptr_t end)
+{
+ uintptr_t page;
+
+ for (page = start & ENTRY_ADDRESS_MASK; page < end; page += PAGE_SIZE)
+ {
+  uint32_t* const entry = page_entry(address_space, page, 1);
+  uint32_t*       frame;
+  int             i;
+
+  if (0 == entry)
+   return 0;
+  if (*entry & PAGE_PRESENT)
+   continue;
+
+  frame = frame_allocate(0);
+  if (0 == frame)
+   return 0;
+  for (i = 0; i < TABLE_ENTRIES; i++)
+   frame[i] = 0;
+
+  *entry = (uintptr_t) frame | PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER |
+           PAGE_OWNED;
+ }
+
+ return 1;
+}
+
+/*! Unmaps all pages entirely inside [start, end) and frees the frames
+    owned by the address space. */
+static void
+decommit_range(struct address_space* const address_space,
+               const uintptr_t start, const uintptr_t end)
+{
+ uintptr_t page;
+ int       unmapped = 0;
+
+ for (page = (start + PAGE_SIZE - 1) & ENTRY_ADDRESS_MASK;
+      page + PAGE_SIZE <= end; page += PAGE_SIZE)
+ {
+  uint32_t* const entry = page_entry(address_space, page, 0);
+
+  if ((0 == entry) || !(*entry & PAGE_PRESENT))
+   continue;
+
+  if (*entry & PAGE_OWNED)
+   frame_release((void*) (*entry & ENTRY_ADDRESS_MASK));
+  *entry = 0;
+  unmapped = 1;
+
+  if (is_loaded(address_space))
+   invlpg(page);
+ }
+
+ if (unmapped)
+  smp_flush_tlbs(address_space->cpus);
+}
+
+/*! Returns non-zero if the page holding address is mapped. */
+static int
+is_mapped(struct address_space* const address_space, const uintptr_t address)
+{
+ const uint32_t* const entry = page_entry(address_space, address, 0);
+
+ return (0 != entry) && (*entry & PAGE_PRESENT);
+}
+
+/*! Zeroes the mapped pages in [start, end) a word at a time. start must be
+    word aligned, and the last word may reach past end. */
+static void
+clear_range(struct address_space* const address_space,
+            uintptr_t start, const uintptr_t end)
+{
+ while (start < end)
+ {
+  const uintptr_t page_end = (start & ENTRY_ADDRESS_MASK) + PAGE_SIZE;
+  const uintptr_t stop     = (page_end < end) ? page_end : end;
+
+  if (is_mapped(address_space, start))
+  {
+   uint32_t* word;
+
+   for (word = (uint32_t*) start; (uintptr_t) word < stop; word++)
+    *word = 0;
+  }
+
+  start = stop;
+ }
+}
+
+/*! Copies length bytes from source to destination, rounded up to a whole
+    number of words. Pages of the source that are not mapped hold zeroes,
+    so they are not read. The matching part of the destination is cleared
+    instead, which only touches pages that are already mapped. */
+static void
+copy_range(struct address_space* const address_space, uintptr_t destination,
+           uintptr_t source, size_t length)
+{
+ while (length > 0)
+ {
+  const size_t page_left = PAGE_SIZE - (source & (PAGE_SIZE - 1));
+  const size_t chunk     = (page_left < length) ? page_left : length;
+
+  if (is_mapped(address_space, source))
+  {
+   const uint32_t* from = (const uint32_t*) source;
+   uint32_t*       to   = (uint32_t*) destination;
+
+   while ((uintptr_t) from < source + chunk)
+    *to++ = *from++;
+  }
+  else
+   clear_range(address_space, destination, destination + chunk);
+
+  destination += chunk;
+  source += chunk;
+  length -= chunk;
+ }
+}
+
+/* Definitions. */
+
+void paging_init(void)
+{
+ uint32_t* low_table;
+ uint32_t  i;
+
+ /* Check if the processor supports 4 MiB and global pages. The kernel
+    mappings depend on the former. */
+ {
+  uint32_t eax, ebx, ecx, edx;
+
+  cpuid(1, &eax, &ebx, &ecx, &edx);
+
+  if (!(0x8 & edx))
+   halt_the_machine();
+
+  global_flag = (0x2000 & edx) ? PAGE_GLOBAL : 0;
+ }
+
+ kernel_page_directory = allocate_table();
+ low_table = allocate_table();
+ if ((0 == kernel_page_directory) || (0 == low_table))
+  halt_the_machine();
+
+ /* The first page stays unmapped to catch null pointers. The embedded
+    applications are only mapped in the address spaces of processes. */
+ for (i = 1; i < TABLE_ENTRIES; i++)
+ {
+  const uint32_t address = i * PAGE_SIZE;
+
+  if ((address < (uintptr_t) exec_0_start) ||
+      (address >= (uintptr_t) end_of_applications))
+   low_table[i] = address | PAGE_PRESENT | PAGE_WRITABLE | global_flag;
+ }
+
+ /* The page directory entry has to allow user access for the embedded
+    applications to be reachable. The kernel entries in the page table do
+    not allow it. */
+ kernel_page_directory[0] = (uintptr_t) low_table | PAGE_PRESENT |
+                            PAGE_WRITABLE | PAGE_USER;
+
+ for (i = 1; (i < TABLE_ENTRIES) &&
+             ((i << 22) < USER_HEAP_START) &&
+             ((i << 22) < top_of_available_physical_memory); i++)
+  kernel_page_directory[i] = (i << 22) | PAGE_PRESENT | PAGE_WRITABLE |
+                             PAGE_LARGE | global_flag;
+
+ object_cache_init(&address_space_cache, "address space",
+                   sizeof(struct address_space));
+
+ paging_init_cpu();
+}
+
+void paging_init_cpu(void)
+{
+ write_cr3((uintptr_t) kernel_page_directory);
+ write_cr4(read_cr4() | CR4_PSE | (global_flag ? CR4_PGE : 0));
+ /* Write protection has to apply to the kernel too, or writes it makes on
+    behalf of a process would not break copy-on-write sharing. */
+ write_cr0(read_cr0() | CR0_PG | CR0_WP);
+}
+
+void paging_map_device(const uintptr_t address)
+{
+ kernel_page_directory[address >> 22] = (address & ~((1 << 22) - 1)) |
+                                        PAGE_PRESENT | PAGE_WRITABLE |
+                                        PAGE_WRITE_THROUGH |
+                                        PAGE_CACHE_DISABLE | PAGE_LARGE |
+                                        global_flag;
+ invlpg(address);
+}
+
+struct address_space* address_space_create(void)
+{
+ struct address_space* const address_space =
+  object_cache_allocate(&address_space_cache);
+ uint32_t*                   low_table;
+ const uint32_t*             kernel_low_table;
+ int                         i;
+
+ if (0 == address_space)
+  return 0;
+
+ address_space->page_directory = allocate_table();
+ low_table = allocate_table();
+ if ((0 == address_space->page_directory) || (0 == low_table))
+ {
+  if (0 != address_space->page_directory)
+   frame_free(address_space->page_directory, 0);
+  if (0 != low_table)
+   frame_free(low_table, 0);
+  object_cache_free(&address_space_cache, address_space);
+  return 0;
+ }
+
+ kernel_low_table = (const uint32_t*) (kernel_page_directory[0] &
+                                       ENTRY_ADDRESS_MASK);
+ for (i = 0; i < TABLE_ENTRIES; i++)
+ {
+  address_space->page_directory[i] = kernel_page_directory[i];
+  low_table[i] = kernel_low_table[i];
+ }
+ address_space->page_directory[0] = (uintptr_t) low_table | PAGE_PRESENT |
+                                    PAGE_WRITABLE | PAGE_USER | PAGE_OWNED;
+
+ extent_heap_init(&address_space->arena);
+ address_space->arena_top = USER_HEAP_START;
+ address_space->cpus = 0;
+ address_space->shared_top = USER_SHARED_START;
+
+ return address_space;
+}
+
+void address_space_destroy(struct address_space* const address_space)
+{
+ uint32_t* const page_directory = address_space->page_directory;
+ int             i;
+
+ if (is_loaded(address_space))
+  address_space_switch(0);
+
+ for (i = 0; i < TABLE_ENTRIES; i++)
+  if ((PAGE_PRESENT | PAGE_OWNED) ==
+      (page_directory[i] & (PAGE_PRESENT | PAGE_OWNED)))
+  {
+   uint32_t* const table = (uint32_t*) (page_directory[i] &
+                                        ENTRY_ADDRESS_MASK);
+   int             j;
+
+   for (j = 0; j < TABLE_ENTRIES; j++)
+    if ((PAGE_PRESENT | PAGE_OWNED) ==
+        (table[j] & (PAGE_PRESENT | PAGE_OWNED)))
+     frame_release((void*) (table[j] & ENTRY_ADDRESS_MASK));
+
+   frame_free(table, 0);
+  }
+
+ frame_free(page_directory, 0);
+ extent_heap_destroy(&address_space->arena);
+ object_cache_free(&address_space_cache, address_space);
+}
+
+struct address_space* address_space_clone(struct address_space* const
+                                           address_space)
+{
+ struct address_space* const copy = address_space_create();
+ int                         i;
+
+ if (0 == copy)
+  return 0;
+
+ if (!extent_heap_clone(&copy->arena, &address_space->arena))
+ {
+  address_space_destroy(copy);
+  return 0;
+ }
+ copy->arena_top = address_space->arena_top;
+ copy->shared_top = address_space->shared_top;
+
+ /* Give the copy its own page tables. Owned pages are turned read-only in
+    both address spaces and copied on the first write, except for shared
+    memory, which the copy shares as well. */
+ for (i = 0; i < TABLE_ENTRIES; i++)
+  if ((PAGE_PRESENT | PAGE_OWNED) ==
+      (address_space->page_directory[i] & (PAGE_PRESENT | PAGE_OWNED)))
+  {
+   uint32_t* const table = (uint32_t*) (address_space->page_directory[i] &
+                                        ENTRY_ADDRESS_MASK);
+   uint32_t* const table_copy = (0 == i) ?
+    (uint32_t*) (copy->page_directory[0] & ENTRY_ADDRESS_MASK) :
+    allocate_table();
+   int             j;
+
+   if (0 == table_copy)
+   {
+    address_space_destroy(copy);
+    return 0;
+   }
+
+   if (0 != i)
+    copy->page_directory[i] = (uintptr_t) table_copy |
+                              (address_space->page_directory[i] &
+                               ~ENTRY_ADDRESS_MASK);
+
+   for (j = 0; j < TABLE_ENTRIES; j++)
+   {
+    if ((PAGE_PRESENT | PAGE_OWNED) == (table[j] & (PAGE_PRESENT | PAGE_OWNED)))
+    {
+     if ((table[j] & PAGE_WRITABLE) && !(table[j] & PAGE_SHARED))
+      table[j] = (table[j] & ~PAGE_WRITABLE) | PAGE_COPY_ON_WRITE;
+     frame_share((void*) (table[j] & ENTRY_ADDRESS_MASK));
+    }
+    table_copy[j] = table[j];
+   }
+  }
+
+ /* Pages that used to be writable are now read-only. */
+ if (is_loaded(address_space))
+  write_cr3(read_cr3());
+ smp_flush_tlbs(address_space->cpus);
+
+ return copy;
+}
+
+int address_space_map(struct address_space* const address_space,
+                      const uintptr_t virtual_address,
+                      const uintptr_t physical_address,
+                      const uint32_t flags)
+{
+ uint32_t* const entry = page_entry(address_space, virtual_address, 1);
+
+ if (0 == entry)
+  return 0;
+
+ *entry = (physical_address & ENTRY_ADDRESS_MASK) | flags | PAGE_PRESENT;
+
+ if (is_loaded(address_space))
+  invlpg(virtual_address);
+
+ return 1;
+}
+
+uintptr_t address_space_share(struct address_space* const first,
+                              struct address_space* const second,
+                              const size_t size)
+{
+ const uintptr_t start = (first->shared_top > second->shared_top) ?
+                         first->shared_top : second->shared_top;
+ const uint32_t  flags = PAGE_USER | PAGE_WRITABLE | PAGE_OWNED |
+                         PAGE_SHARED;
+ uintptr_t       page;
+
+ if ((0 == size) || (size > USER_SHARED_END - start))
+  return 0;
+
+ /* The range is used up in both address spaces even if memory runs out
+    part way, as some pages may be mapped already. They are released when
+    the address spaces are destroyed. */
+ first->shared_top = (start + size + PAGE_SIZE - 1) & ENTRY_ADDRESS_MASK;
+ second->shared_top = first->shared_top;
+
+ for (page = start; page < first->shared_top; page += PAGE_SIZE)
+ {
+  uint32_t* const frame = frame_allocate(0);
+  int             i;
+
+  if (0 == frame)
+   return 0;
+
+  for (i = 0; i < TABLE_ENTRIES; i++)
+   frame[i] = 0;
+
+  if (!address_space_map(first, page, (uintptr_t) frame, flags))
+  {
+   frame_free(frame, 0);
+   return 0;
+  }
+
+  if (second != first)
+  {
+   frame_share(frame);
+   if (!address_space_map(second, page, (uintptr_t) frame, flags))
+   {
+    frame_release(frame);
+    return 0;
+   }
+  }
+ }
+
+ return start;
+}
+
+uintptr_t address_space_shared_address(struct address_space* const
+                                        address_space,
+                                       const uintptr_t address)
+{
+ const uint32_t* entry;
+
+ if ((address < USER_SHARED_START) || (address >= USER_SHARED_END))
+  return 0;
+
+ entry = page_entry(address_space, address, 0);
+ if ((0 == entry) ||
+     ((PAGE_PRESENT | PAGE_SHARED) != (*entry & (PAGE_PRESENT | PAGE_SHARED))))
+  return 0;
+
+ return (*entry & ENTRY_ADDRESS_MASK) | (address & (PAGE_SIZE - 1));
+}
+
+int address_space_handle_fault(struct address_space* const address_space,
+                               const uintptr_t address,
+                               const uint32_t error_code)
+{
+ /* Writes to pages shared after a clone get a private copy of the page,
+    unless no other address space refers to the frame anymore. */
+ if ((FAULT_PROTECTION | FAULT_WRITE) ==
+     (error_code & (FAULT_PROTECTION | FAULT_WRITE)))
+ {
+  uint32_t* const entry = page_entry(address_space, address, 0);
+  uint32_t*       frame;
+
+  /* Another cpu may have copied the page since the fault was raised. */
+  if ((0 == entry) || !(*entry & PAGE_COPY_ON_WRITE))
+   return (0 != entry) &&
+          ((PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER) ==
+           (*entry & (PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER)));
+
+  frame = (uint32_t*) (*entry & ENTRY_ADDRESS_MASK);
+  if (frame_is_shared(frame))
+  {
+   uint32_t* const copy = frame_allocate(0);
+   int             i;
+
+   if (0 == copy)
+    return 0;
+   for (i = 0; i < TABLE_ENTRIES; i++)
+    copy[i] = frame[i];
+
+   frame_release(frame);
+   frame = copy;
+  }
+
+  *entry = (uintptr_t) frame | (*entry & ~ENTRY_ADDRESS_MASK &
+                                ~PAGE_COPY_ON_WRITE) | PAGE_WRITABLE;
+  invlpg(address);
+  smp_flush_tlbs(address_space->cpus);
+  return 1;
+ }
+
+ /* Pages of the heap are backed by a zeroed frame when they are first
+    touched inside an allocated block. Touching the rest of the heap range
+    is a bad access like any other. */
+ if (!(error_code & FAULT_PROTECTION) &&
+     (address >= USER_HEAP_START) && (address < address_space->arena_top) &&
+     extent_heap_is_used(&address_space->arena, address, address + 1))
+  return commit_range(address_space, address, address + 1);
+
+ return 0;
+}
+
+int address_space_is_writable(struct address_space* const address_space,
+                              const uintptr_t start, const size_t length)
+{
+ uintptr_t page;
+
+ if (start + length < start)
+  return 0;
+
+ for (page = start & ENTRY_ADDRESS_MASK; page < start + length;
+      page += PAGE_SIZE)
+ {
+  const uint32_t* const entry = page_entry(address_space, page, 0);
+
+  /* Heap pages that have not been touched yet are mapped on the first
+     write, if the range is inside an allocated block there. */
+  if ((page >= USER_HEAP_START) && (page < address_space->arena_top) &&
+      ((0 == entry) || !(*entry & PAGE_PRESENT)))
+  {
+   const uintptr_t first = (page > start) ? page : start;
+   const uintptr_t last  = (page + PAGE_SIZE < start + length) ?
+                           page + PAGE_SIZE : start + length;
+
+   if (!extent_heap_is_used(&address_space->arena, first, last))
+    return 0;
+   continue;
+  }
+
+  if ((0 == entry) || !(*entry & PAGE_PRESENT) || !(*entry & PAGE_USER) ||
+      !(*entry & (PAGE_WRITABLE | PAGE_COPY_ON_WRITE)))
+   return 0;
+ }
+
+ return 1;
+}
+
+int address_space_is_readable(struct address_space* const address_space,
+                              const uintptr_t start, const size_t length)
+{
+ uintptr_t page;
+
+ if (start + length < start)
+  return 0;
+
+ for (page = start & ENTRY_ADDRESS_MASK; page < start + length;
+      page += PAGE_SIZE)
+ {
+  const uint32_t* const entry = page_entry(address_space, page, 0);
+
+  /* Heap pages that have not been touched yet read as zeroes once they
+     are mapped, if the range is inside an allocated block there. */
+  if ((page >= USER_HEAP_START) && (page < address_space->arena_top) &&
+      ((0 == entry) || !(*entry & PAGE_PRESENT)))
+  {
+   const uintptr_t first = (page > start) ? page : start;
+   const uintptr_t last  = (page + PAGE_SIZE < start + length) ?
+                           page + PAGE_SIZE : start + length;
+
+   if (!extent_heap_is_used(&address_space->arena, first, last))
+    return 0;
+   continue;
+  }
+
+  if ((0 == entry) || !(*entry & PAGE_PRESENT) || !(*entry & PAGE_USER))
+   return 0;
+ }
+
+ return 1;
+}
+
+void address_space_switch(struct address_space* const address_space)
+{
+ const uint32_t               id     = this_cpu()->id;
+ struct address_space* const loaded = loaded_address_spaces[id];
+
+ if (address_space == loaded)
+  return;
+
+ if (0 != loaded)
+  loaded->cpus &= ~(1U << id);
+ if (0 != address_space)
+  address_space->cpus |= 1U << id;
+ loaded_address_spaces[id] = address_space;
+
+ write_cr3((uintptr_t) ((0 != address_space) ? address_space->page_directory :
+                                              kernel_page_directory));
+}
+
+void* arena_allocate(struct address_space* const address_space,
+                     const size_t size, const size_t alignment,
+                     const int zeroed)
+{
+ void* block;
+
+ /* The whole heap range is handed to the arena the first time it is used.
+    This only reserves the range, frames are mapped when pages are
+    touched. */
+ if (USER_HEAP_START == address_space->arena_top)
+ {
+  if (!extent_heap_add_region(&address_space->arena, USER_HEAP_START,
+                              USER_HEAP_END))
+   return 0;
+  address_space->arena_top = USER_HEAP_END;
+ }
+
+ block = extent_heap_allocate(&address_space->arena, size, alignment);
+ if (0 == block)
+  return 0;
+
+ if ((size < ARENA_LAZY_THRESHOLD) &&
+     !commit_range(address_space, (uintptr_t) block,
+                   (uintptr_t) block + size))
+ {
+  extent_heap_free(&address_space->arena, block);
+  return 0;
+ }
+
+ /* Pages that are not mapped yet are zeroed when they are first
+    touched. */
+ if (zeroed)
+  clear_range(address_space, (uintptr_t) block, (uintptr_t) block + size);
+
+ return block;
+}
+
+void* arena_resize(struct address_space* const address_space,
+                   void* const ptr, const size_t size)
+{
+ const size_t old_size = extent_heap_usable_size(&address_space->arena, ptr);
+ void*        block;
+
+ if (0 == old_size)
+  return 0;
+
+ if (extent_heap_resize(&address_space->arena, ptr, size))
+  return ptr;
+
+ block = arena_allocate(address_space, size, 0, 0);
+ if (0 == block)
+  return 0;
+
+ copy_range(address_space, (uintptr_t) block, (uintptr_t) ptr,
+            (old_size < size) ? old_size : size);
+ arena_free(address_space, ptr);
+
+ return block;
+}
+
+int arena_free(struct address_space* const address_space, void* const ptr)
+{
+ const size_t size = extent_heap_usable_size(&address_space->arena, ptr);
+
+ if (0 == size)
+  return 0;
+
+ /* Give back the frames of large blocks. The heap keeps nothing in the
+    block, so all pages inside it can go. */
+ if (size >= ARENA_LAZY_THRESHOLD)
+  decommit_range(address_space, (uintptr_t) ptr, (uintptr_t) ptr + size);
+
+ return extent_heap_free(&address_space->arena, ptr);
+}
+
+#ifdef BENCHMARK
+
+/*! Number of address space switches measured. */
+#define BENCHMARK_SWITCHES     (1000)
+
+/*! Number of 4 KiB kernel pages touched after each switch. */
+#define BENCHMARK_SMALL_PAGES  (16)
+
+/*! Switches back and forth between two page directories and touches a set
+    of kernel pages after each switch, as the kernel would on its way
+    through a system call. Returns the average number of cycles per
+    switch. */
+static uint32_t
+measure_switches(const uint32_t* const first, const uint32_t* const second)
+{
+ uint32_t start;
+ int      i;
+
+ start = (uint32_t) rdtsc();
+ for (i = 0; i < BENCHMARK_SWITCHES; i++)
+ {
+  uint32_t j;
+
+  write_cr3((uintptr_t) ((i & 1) ? second : first));
+
+  for (j = 0; j < BENCHMARK_SMALL_PAGES; j++)
+   (void) *(volatile const uint32_t*) ((uintptr_t) start_of_kernel +
+                                       j * PAGE_SIZE);
+
+  for (j = 1 << 22; (j < top_of_available_physical_memory) &&
+                    (j < USER_HEAP_START); j += 1 << 22)
+   (void) *(volatile const uint32_t*) j;
+ }
+
+ return ((uint32_t) rdtsc() - start) / BENCHMARK_SWITCHES;
+}
+
+void paging_benchmark(void)
+{
+ struct address_space* const scratch = address_space_create();
+ const uint32_t              loaded  = read_cr3();
+
+ if (0 == scratch)
+  return;
+
+ kprints("Cycles per address space switch, global kernel pages: ");
+ kprinthex(measure_switches(kernel_page_directory, scratch->page_directory));
+
+ /* Clearing cr4.PGE flushes all global entries and makes the processor
+    ignore the global flag until it is set again. */
+ write_cr4(read_cr4() & ~CR4_PGE);
+ kprints("Cycles per address space switch, no global pages: ");
+ kprinthex(measure_switches(kernel_page_directory, scratch->page_directory));
+ write_cr4(read_cr4() | (global_flag ? CR4_PGE : 0));
+
+ write_cr3(loaded);
+ address_space_destroy(scratch);
+}
+
+#endif
@@ -0,0 +1,163 @@
+/* Copyright (c) 1997-2016, FenixOS Developers
+   All Rights Reserved.
+
+   This file is subject to the terms and conditions defined in
+   file 'LICENSE', which is part of this source code package.
+ */
+
+/*! \file vm.h Paging and per-process address spaces. */
+
+#ifndef _VM_H_
+#define _VM_H_
+
+#include <stdint.h>
+#include "mm.h"
+
+/** Size of a page in bytes. */
+#define PAGE_SIZE       (4096)
+
+/** The page is mapped. */
+#define PAGE_PRESENT    (0x001)
+/** The page can be written. */
+#define PAGE_WRITABLE   (0x002)
+/** The page can be accessed from user space. */
+#define PAGE_USER       (0x004)
+/** Writes to the page go straight to memory. */
+#define PAGE_WRITE_THROUGH (0x008)
+/** The page is not cached. */
+#define PAGE_CACHE_DISABLE (0x010)
+/** The page directory entry maps a 4 MiB page. */
+#define PAGE_LARGE      (0x080)
+/** The TLB entry of the page survives cr3 reloads. */
+#define PAGE_GLOBAL     (0x100)
+/** The frame belongs to the address space and is freed with it. This is one of the bits the processor leaves to software. */
+#define PAGE_OWNED      (0x200)
+/** The page is shared read-only with other address spaces and is copied when written. This is one of the bits the processor leaves to software. */
+#define PAGE_COPY_ON_WRITE (0x400)
+/** The frame is mapped on purpose into several address spaces, which all see writes to it. This is one of the bits the processor leaves to software. */
+#define PAGE_SHARED     (0x800)
+
+/** Start of the range of virtual memory used for the heap of each process. Physical memory is identity mapped below it. */
+#define USER_HEAP_START (0x80000000)
+/** End of the range of virtual memory used for the heap of each process. */
+#define USER_HEAP_END   (0xc0000000)
+/** Start of the range of virtual memory used for memory shared between processes. */
+#define USER_SHARED_START (0xc0000000)
+/** End of the range of virtual memory used for memory shared between processes. */
+#define USER_SHARED_END (0xe0000000)
+
+/** Defines the address space of a process. */
+struct address_space
+{
+ uint32_t*   page_directory; /**< Physical address of the page directory. */
+ struct extent_heap arena;   /**< The memory allocated by the process. Its bookkeeping is in kernel memory, out of reach of the process. */
+ uintptr_t   arena_top;      /**< End of the part of the user heap range handed to arena. Either USER_HEAP_START or USER_HEAP_END. */
+ uint32_t    cpus;           /**< Bit mask of the cpus that have the address space loaded. Their TLBs are flushed when mappings are removed or made read-only. */
+ uintptr_t   shared_top;     /**< End of the part of the shared range used so far. Shared memory is not unmapped before the address space is destroyed, so the range is not reused. */
+};
+
+/**
+ * @name    paging_init
+ * @brief   Builds the kernel page tables and turns on paging. Physical memory below USER_HEAP_START is identity mapped with global 4 MiB pages, except for the first 4 MiB which hold the embedded applications and are mapped with 4 KiB pages.
+ */
+void paging_init(void);
+
+/**
+ * @name    paging_init_cpu
+ * @brief   Turns on paging with the kernel page tables on a cpu other than the one paging_init ran on.
+ */
+void paging_init_cpu(void);
+
+/**
+ * @name    paging_map_device
+ * @brief   Maps the 4 MiB of physical memory holding address, uncached and identity mapped, into the kernel mappings. It must lie above USER_HEAP_END. Address spaces created before the call do not get the mapping.
+ */
+void paging_map_device(uintptr_t address);
+
+/**
+ * @name    address_space_create
+ * @brief   Creates an address space holding the kernel mappings only. Returns 0 if memory is exhausted.
+ */
+struct address_space* address_space_create(void);
+
+/**
+ * @name    address_space_destroy
+ * @brief   Frees an address space with its page tables and drops its references to all frames mapped with PAGE_OWNED.
+ */
+void address_space_destroy(struct address_space* address_space);
+
+/**
+ * @name    address_space_clone
+ * @brief   Creates a copy of an address space, heap included. Pages owned by it are shared read-only by both address spaces until either writes to them. Returns 0 if memory is exhausted.
+ */
+struct address_space* address_space_clone(struct address_space* address_space);
+
+/**
+ * @name    address_space_map
+ * @brief   Maps the page at virtual_address to the frame at physical_address with the given flags. Returns zero if memory is exhausted or the address is covered by a 4 MiB kernel page.
+ */
+int address_space_map(struct address_space* address_space, uintptr_t virtual_address, uintptr_t physical_address, uint32_t flags);
+
+/**
+ * @name    address_space_share
+ * @brief   Maps size bytes of zeroed memory into two address spaces at the same address in the shared range, and returns the address. Both address spaces see writes made by either, as do their clones. first and second may be the same. Returns 0 if memory or the shared range of either address space is exhausted.
+ */
+uintptr_t address_space_share(struct address_space* first, struct address_space* second, size_t size);
+
+/**
+ * @name    address_space_shared_address
+ * @brief   Returns the physical address address maps to if it lies in memory mapped by address_space_share, otherwise 0. It identifies a word the same way in all address spaces sharing it.
+ */
+uintptr_t address_space_shared_address(struct address_space* address_space, uintptr_t address);
+
+/**
+ * @name    address_space_handle_fault
+ * @brief   Tries to resolve a page fault at address with the error code pushed by the processor. Returns zero if the access is not allowed.
+ */
+int address_space_handle_fault(struct address_space* address_space, uintptr_t address, uint32_t error_code);
+
+/**
+ * @name    address_space_is_writable
+ * @brief   Returns non-zero if user space may write to all of [start, start + length) in the address space.
+ */
+int address_space_is_writable(struct address_space* address_space, uintptr_t start, size_t length);
+
+/**
+ * @name    address_space_is_readable
+ * @brief   Returns non-zero if user space may read all of [start, start + length) in the address space.
+ */
+int address_space_is_readable(struct address_space* address_space, uintptr_t start, size_t length);
+
+/**
+ * @name    address_space_switch
+ * @brief   Makes address_space the current address space. cr3 is only reloaded when the address space changes. Passing 0 selects the kernel page tables.
+ */
+void address_space_switch(struct address_space* address_space);
+
+/**
+ * @name    arena_allocate
+ * @brief   Allocates at least size contiguous bytes from the heap of an address space, at a multiple of alignment if it is not 0. The block is cleared if zeroed is set. The address space must be the current one. Large blocks are only backed by frames as they are touched. Returns 0 if memory is exhausted or alignment is not a power of two.
+ */
+void* arena_allocate(struct address_space* address_space, size_t size, size_t alignment, int zeroed);
+
+/**
+ * @name    arena_resize
+ * @brief   Resizes a block allocated from the heap of an address space. The block is grown in place if possible, otherwise its contents are moved to a new block. The address space must be the current one. Returns the address of the block, or 0 leaving the block unchanged.
+ */
+void* arena_resize(struct address_space* address_space, void* ptr, size_t size);
+
+/**
+ * @name    arena_free
+ * @brief   Frees a block allocated from the heap of the same address space. The address space need not be the current one. Returns zero if ptr was not handed out by it.
+ */
+int arena_free(struct address_space* address_space, void* ptr);
+
+#ifdef BENCHMARK
+/**
+ * @name    paging_benchmark
+ * @brief   Measures the cost of switching address spaces with and without global kernel pages and prints the result.
+ */
+void paging_benchmark(void);
+#endif
+
+#endif
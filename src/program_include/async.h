@@ -0,0 +1,116 @@
+/* Copyright (c) 1997-2016, FenixOS Developers
+   All Rights Reserved.
+
+   This file is subject to the terms and conditions defined in
+   file 'LICENSE', which is part of this source code package.
+ */
+
+/*! \file async.h
+ *  This file contains functions that queue operations in the rings set up
+ *  with async_setup and take their completions. Operations are queued
+ *  without entering the kernel. The kernel carries them out when
+ *  async_enter is called, or without any call when a cpu has nothing else
+ *  to run. One kernel entry thus serves as many operations as the ring
+ *  holds.
+ *
+ *  Only one thread at a time may queue operations, and only one may take
+ *  completions.
+ */
+
+#ifndef _ASYNC_H_
+#define _ASYNC_H_
+
+#include <scwrapper.h>
+
+/*! Keeps the compiler from moving memory accesses across the call. The
+ *  processor does not reorder stores with stores or loads with loads.
+ */
+static inline void
+async_barrier(void)
+{
+ __asm volatile("" : : : "memory");
+}
+
+/*! Queues an operation. Returns zero if the submission ring is full, in
+ *  which case async_enter makes room.
+ *  @param rings the rings.
+ *  @param operation a system call or ASYNC_TIMEOUT, see ASYNC_TIMEOUT.
+ *  @param user_data handed back in the completion.
+ *  @param first first argument, passed in edi to the system call.
+ *  @param second second argument, passed in esi.
+ *  @param third third argument, passed in ebx.
+ */
+static inline int
+async_submit(struct async_rings* const rings, const int32_t operation,
+             const uint32_t user_data, const uint32_t first,
+             const uint32_t second, const uint32_t third)
+{
+ const uint32_t           tail = rings->submission_tail;
+ struct async_submission* submission;
+
+ if (tail - rings->submission_head >= rings->submission_entries)
+  return 0;
+
+ submission = (struct async_submission*)
+              ((uint8_t*) rings + rings->submissions) +
+              (tail & (rings->submission_entries - 1));
+ submission->operation = operation;
+ submission->user_data = user_data;
+ submission->arguments[0] = first;
+ submission->arguments[1] = second;
+ submission->arguments[2] = third;
+
+ async_barrier();
+ rings->submission_tail = tail + 1;
+ return 1;
+}
+
+/*! Takes the oldest completion. Returns zero if there is none.
+ *  @param rings the rings.
+ *  @param completion filled in with the completion.
+ */
+static inline int
+async_reap(struct async_rings* const rings,
+           struct async_completion* const completion)
+{
+ const uint32_t head = rings->completion_head;
+
+ if (head == rings->completion_tail)
+  return 0;
+ async_barrier();
+
+ *completion = ((struct async_completion*)
+                ((uint8_t*) rings + rings->completions))
+               [head & (rings->completion_entries - 1)];
+
+ async_barrier();
+ rings->completion_head = head + 1;
+ return 1;
+}
+
+/*! Takes the oldest completion, sleeping until there is one. Operations
+ *  still in the submission ring are carried out first.
+ *  @param rings the rings.
+ *  @param completion filled in with the completion.
+ */
+static inline void
+async_wait(struct async_rings* const rings,
+           struct async_completion* const completion)
+{
+ for (;;)
+ {
+  /* The tail is read before the ring is looked at, so a completion queued
+     after async_reap fails moves it past the value waited on. */
+  const uint32_t tail = rings->completion_tail;
+
+  if (async_reap(rings, completion))
+   return;
+
+  if (rings->submission_head != rings->submission_tail)
+   async_enter();
+  else
+   wait(&rings->completion_tail, tail);
+ }
+}
+
+#endif /* _ASYNC_H_ */
@@ -0,0 +1,273 @@
+/* Copyright (c) 1997-2016, FenixOS Developers
+   All Rights Reserved.
+
+   This file is subject to the terms and conditions defined in
+   file 'LICENSE', which is part of this source code package.
+ */
+
+/*! \file malloc.h
+ *  This file contains a memory allocator for user programs. Small requests
+ *  are served from free lists kept in the program, so they do not enter the
+ *  kernel. Memory is taken from the kernel in chunks and given back when a
+ *  chunk is empty.
+ *
+ *  Each chunk is CHUNK_SIZE bytes, aligned to its size, and holds objects
+ *  of one size class. The chunk an object belongs to is found by clearing
+ *  the low bits of its address. Requests too large for any size class get a
+ *  chunk of their own, aligned the same way, so the header is found in the
+ *  same place.
+ *
+ *  The threads of a program share the free lists, which are guarded by a
+ *  mutex. Large requests and blocks do not touch the lists and are not
+ *  locked.
+ */
+
+#ifndef _MALLOC_H_
+#define _MALLOC_H_
+
+#include <scwrapper.h>
+#include <sync.h>
+
+/*! Size of the chunks taken from the kernel for small objects. */
+#define CHUNK_SIZE          (64 * 1024)
+
+/*! Alignment of all objects handed out. */
+#define MALLOC_ALIGNMENT    (16)
+
+/*! Number of size classes. */
+#define MALLOC_CLASSES      (14)
+
+/*! Largest request served from a size class. */
+#define MALLOC_MAX_SMALL    (2048)
+
+/*! Class of chunks holding a single large block. */
+#define MALLOC_LARGE        (MALLOC_CLASSES)
+
+/*! Size of the objects in each size class. */
+static const uint16_t malloc_class_sizes[MALLOC_CLASSES] =
+ {16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048};
+
+/*! Defines the header found first in every chunk. */
+struct chunk
+{
+ struct chunk* next;        /*!< Next chunk with free objects in the same
+                                 class. */
+ struct chunk* previous;    /*!< Previous chunk with free objects in the
+                                 same class. */
+ void*         free_list;   /*!< Objects freed in this chunk. Each holds a
+                                 pointer to the next. */
+ uint8_t*      unused;      /*!< Objects from here on have never been
+                                 handed out. */
+ uint32_t      class;       /*!< Size class, or MALLOC_LARGE. */
+ uint32_t      used;        /*!< Number of objects handed out. */
+ uint32_t      capacity;    /*!< Number of objects that fit in the chunk. */
+ uint32_t      listed;      /*!< Set while the chunk is in the list of its
+                                 class. */
+};
+
+/*! Offset of the first object from the start of a chunk. */
+#define CHUNK_HEADER_SIZE   ((sizeof(struct chunk) + MALLOC_ALIGNMENT - 1) & \
+                             ~(MALLOC_ALIGNMENT - 1))
+
+/*! State of the allocator. */
+static struct
+{
+ struct chunk* partial[MALLOC_CLASSES]; /*!< Chunks with free objects. */
+ struct chunk* empty[MALLOC_CLASSES];   /*!< An empty chunk kept in each
+                                             class so a program that
+                                             allocates and frees a single
+                                             object does not fetch and
+                                             return a chunk every time. */
+ uint8_t       class_of[MALLOC_MAX_SMALL / MALLOC_ALIGNMENT + 1]; /*!< Size
+                                             class for each request size in
+                                             units of MALLOC_ALIGNMENT. */
+ int           initialized;
+ struct mutex  lock;                    /*!< Guards the fields above and
+                                             the headers of the chunks of
+                                             the size classes. Free while
+                                             zero, so it needs no set up. */
+} malloc_state;
+
+/*! Links a chunk into the list of its class. The lock must be held. */
+static inline void
+malloc_link(struct chunk* const c)
+{
+ c->previous = 0;
+ c->next = malloc_state.partial[c->class];
+ if (0 != c->next)
+  c->next->previous = c;
+ malloc_state.partial[c->class] = c;
+ c->listed = 1;
+}
+
+/*! Removes a chunk from the list of its class. The lock must be held. */
+static inline void
+malloc_unlink(struct chunk* const c)
+{
+ if (0 != c->next)
+  c->next->previous = c->previous;
+ if (0 != c->previous)
+  c->previous->next = c->next;
+ else
+  malloc_state.partial[c->class] = c->next;
+ c->listed = 0;
+}
+
+/*! Gets a chunk from the kernel and sets up its header. Returns 0 if the
+ *  kernel is out of memory.
+ */
+static inline struct chunk*
+malloc_new_chunk(const uint32_t class, const uint32_t size)
+{
+ struct chunk* const c = alloc_aligned(size, CHUNK_SIZE);
+
+ if ((0 == c) || ((void*) ERROR == c))
+  return 0;
+
+ c->next = 0;
+ c->previous = 0;
+ c->free_list = 0;
+ c->unused = (uint8_t*) c + CHUNK_HEADER_SIZE;
+ c->class = class;
+ c->used = 0;
+ c->capacity = (MALLOC_LARGE == class) ? 1 :
+               (CHUNK_SIZE - CHUNK_HEADER_SIZE) / malloc_class_sizes[class];
+ c->listed = 0;
+
+ return c;
+}
+
+/*! Allocates at least length bytes. Returns 0 if memory is exhausted.
+ *  @param length number of bytes to allocate.
+ */
+static inline void*
+malloc(const uint32_t length)
+{
+ struct chunk* c;
+ void*         object;
+ uint32_t      class;
+
+ if (0 == length)
+  return 0;
+
+ /* Large requests get a chunk of their own. */
+ if (length > MALLOC_MAX_SMALL)
+ {
+  if (length > (uint32_t) INT32_MAX - CHUNK_HEADER_SIZE)
+   return 0;
+  c = malloc_new_chunk(MALLOC_LARGE, length + CHUNK_HEADER_SIZE);
+  if (0 == c)
+   return 0;
+  c->used = 1;
+  return c->unused;
+ }
+
+ mutex_lock(&malloc_state.lock);
+
+ if (!malloc_state.initialized)
+ {
+  uint32_t units;
+
+  class = 0;
+  for (units = 0; units <= MALLOC_MAX_SMALL / MALLOC_ALIGNMENT; units++)
+  {
+   while (malloc_class_sizes[class] < units * MALLOC_ALIGNMENT)
+    class++;
+   malloc_state.class_of[units] = class;
+  }
+  malloc_state.initialized = 1;
+ }
+
+ class = malloc_state.class_of[(length + MALLOC_ALIGNMENT - 1) /
+                               MALLOC_ALIGNMENT];
+
+ c = malloc_state.partial[class];
+ if (0 == c)
+ {
+  c = malloc_state.empty[class];
+  if (0 != c)
+   malloc_state.empty[class] = 0;
+  else
+  {
+   c = malloc_new_chunk(class, CHUNK_SIZE);
+   if (0 == c)
+   {
+    mutex_unlock(&malloc_state.lock);
+    return 0;
+   }
+  }
+  malloc_link(c);
+ }
+
+ if (0 != c->free_list)
+ {
+  object = c->free_list;
+  c->free_list = *(void**) object;
+ }
+ else
+ {
+  object = c->unused;
+  c->unused += malloc_class_sizes[class];
+ }
+
+ if (++c->used == c->capacity)
+  malloc_unlink(c);
+
+ mutex_unlock(&malloc_state.lock);
+ return object;
+}
+
+/*! Frees memory returned by malloc. Whole chunks are given back to the
+ *  kernel once they are empty.
+ *  @param address address returned by malloc, or 0.
+ */
+static inline void
+mfree(void* const address)
+{
+ struct chunk* const c =
+  (struct chunk*) ((uintptr_t) address & ~(uintptr_t) (CHUNK_SIZE - 1));
+
+ if (0 == address)
+  return;
+
+ if (MALLOC_LARGE == c->class)
+ {
+  free(c);
+  return;
+ }
+
+ mutex_lock(&malloc_state.lock);
+
+ *(void**) address = c->free_list;
+ c->free_list = address;
+ c->used--;
+
+ if (0 != c->used)
+ {
+  if (!c->listed)
+   malloc_link(c);
+  mutex_unlock(&malloc_state.lock);
+  return;
+ }
+
+ /* The chunk is empty. Keep one per class, give the rest back. The objects
+    are handed out again from the start of the chunk. */
+ if (c->listed)
+  malloc_unlink(c);
+
+ c->free_list = 0;
+ c->unused = (uint8_t*) c + CHUNK_HEADER_SIZE;
+
+ if (0 == malloc_state.empty[c->class])
+ {
+  malloc_state.empty[c->class] = c;
+  mutex_unlock(&malloc_state.lock);
+ }
+ else
+ {
+  mutex_unlock(&malloc_state.lock);
+  free(c);
+ }
+}
+
+#endif /* _MALLOC_H_ */
@@ -0,0 +1,219 @@
+/* Copyright (c) 1997-2016, FenixOS Developers
+   All Rights Reserved.
+
+   This file is subject to the terms and conditions defined in
+   file 'LICENSE', which is part of this source code package.
+ */
+
+/*! \file ring.h
+ *  This file contains a queue of fixed size entries passed from one
+ *  producer to one consumer, usually in two processes sharing the memory
+ *  it lives in, see share_memory. Entries are copied in and out without
+ *  entering the kernel. A side only enters the kernel to sleep when the
+ *  ring is full or empty, and to wake the other side when that one
+ *  sleeps.
+ *
+ *  The producer only writes tail and the consumer only writes head. The
+ *  two are kept in separate cache lines, so the sides do not take the
+ *  line the other one writes from it on every entry. Each side also keeps
+ *  the last value of the other index it read and reads the index again
+ *  only when the copy says the ring is full or empty.
+ *
+ *  An index is published with a locked instruction, so the following read
+ *  of the waiting flag of the other side can not pass it. Together with the
+ *  locked write of the flag by a side going to sleep this makes sure a
+ *  side never sleeps on an index that has moved. A push or pop of many
+ *  entries publishes the index once.
+ */
+
+#ifndef _RING_H_
+#define _RING_H_
+
+#include <scwrapper.h>
+#include <instruction_wrappers.h>
+
+/*! Size of a cache line. The indices of the two sides are this far apart. */
+#define RING_CACHE_LINE     (64)
+
+/*! Defines the header of a ring. The entries follow it. */
+struct ring
+{
+ volatile uint32_t tail;              /*!< Number of entries pushed. */
+ uint32_t          head_seen;         /*!< Value of head last read by the
+                                           producer. */
+ uint8_t           producer_line[RING_CACHE_LINE - 2 * sizeof(uint32_t)];
+ volatile uint32_t head;              /*!< Number of entries popped. */
+ uint32_t          tail_seen;         /*!< Value of tail last read by the
+                                           consumer. */
+ uint8_t           consumer_line[RING_CACHE_LINE - 2 * sizeof(uint32_t)];
+ volatile uint32_t producer_waiting;  /*!< Set while the producer may sleep
+                                           on head. */
+ volatile uint32_t consumer_waiting;  /*!< Set while the consumer may sleep
+                                           on tail. */
+ uint32_t          capacity;          /*!< Number of entries. A power of
+                                           two. */
+ uint32_t          entry_size;        /*!< Size of an entry in bytes. A
+                                           multiple of 4. */
+ uint8_t           shared_line[RING_CACHE_LINE - 4 * sizeof(uint32_t)];
+ uint32_t          entries[];         /*!< The entries. */
+};
+
+/*! Keeps the compiler from moving memory accesses across the call. */
+static inline void
+ring_barrier(void)
+{
+ __asm volatile("" : : : "memory");
+}
+
+/*! Sets up a ring in memory that both sides can reach. Returns the ring,
+ *  or 0 if not even one entry fits.
+ *  @param memory where the ring is placed. It should be aligned to
+ *                RING_CACHE_LINE.
+ *  @param size number of bytes at memory.
+ *  @param entry_size size of each entry in bytes.
+ */
+static inline struct ring*
+ring_init(void* const memory, const uint32_t size, const uint32_t entry_size)
+{
+ struct ring* const ring = memory;
+ const uint32_t     rounded = (entry_size + 3) & ~(uint32_t) 3;
+ uint32_t           capacity = 1;
+
+ if ((0 == rounded) || (size < sizeof(struct ring) + rounded))
+  return 0;
+
+ while (capacity * 2 <= (size - sizeof(struct ring)) / rounded)
+  capacity *= 2;
+
+ ring->tail = 0;
+ ring->head_seen = 0;
+ ring->head = 0;
+ ring->tail_seen = 0;
+ ring->producer_waiting = 0;
+ ring->consumer_waiting = 0;
+ ring->capacity = capacity;
+ ring->entry_size = rounded;
+
+ return ring;
+}
+
+/*! Sleeps until the index at word no longer holds value, unless it has
+ *  moved already. The flag tells the other side to wake the caller.
+ */
+static inline void
+ring_sleep(volatile uint32_t* const word, volatile uint32_t* const waiting,
+           const uint32_t value)
+{
+ lock_xchg(waiting, 1);
+ if (*word == value)
+  wait(word, value);
+ *waiting = 0;
+}
+
+/*! Makes value the index at word and wakes the other side if it sleeps on
+ *  it.
+ */
+static inline void
+ring_publish(volatile uint32_t* const word, volatile uint32_t* const waiting,
+             const uint32_t value)
+{
+ lock_xchg(word, value);
+ if (*waiting)
+  wake(word, 1);
+}
+
+/*! Pushes entries, sleeping while the ring is full. Must only be called
+ *  by the producer.
+ *  @param ring the ring.
+ *  @param entries count entries of entry_size bytes each.
+ *  @param count number of entries to push.
+ */
+static inline void
+ring_push(struct ring* const ring, const void* const entries, uint32_t count)
+{
+ const uint32_t  words = ring->entry_size / sizeof(uint32_t);
+ const uint32_t* from = entries;
+ uint32_t        tail = ring->tail;
+
+ while (count > 0)
+ {
+  uint32_t space = ring->capacity - (tail - ring->head_seen);
+  uint32_t i;
+
+  if (0 == space)
+  {
+   ring->head_seen = ring->head;
+   space = ring->capacity - (tail - ring->head_seen);
+   if (0 == space)
+   {
+    ring_sleep(&ring->head, &ring->producer_waiting, ring->head_seen);
+    continue;
+   }
+   ring_barrier();
+  }
+
+  if (space > count)
+   space = count;
+
+  for (i = 0; i < space; i++, tail++)
+  {
+   uint32_t* const to = &ring->entries[(tail & (ring->capacity - 1)) * words];
+   uint32_t        j;
+
+   for (j = 0; j < words; j++)
+    to[j] = from[j];
+   from += words;
+  }
+
+  count -= space;
+  ring_publish(&ring->tail, &ring->consumer_waiting, tail);
+ }
+}
+
+/*! Pops at least one and at most count entries, sleeping while the ring is
+ *  empty. Returns the number of entries popped. Must only be called by the
+ *  consumer.
+ *  @param ring the ring.
+ *  @param entries room for count entries of entry_size bytes each.
+ *  @param count largest number of entries to pop.
+ */
+static inline uint32_t
+ring_pop(struct ring* const ring, void* const entries, const uint32_t count)
+{
+ const uint32_t words = ring->entry_size / sizeof(uint32_t);
+ uint32_t*      to = entries;
+ uint32_t       head = ring->head;
+ uint32_t       available = ring->tail_seen - head;
+ uint32_t       i;
+
+ if (0 == count)
+  return 0;
+
+ while (0 == available)
+ {
+  ring->tail_seen = ring->tail;
+  available = ring->tail_seen - head;
+  if (0 == available)
+   ring_sleep(&ring->tail, &ring->consumer_waiting, head);
+ }
+ ring_barrier();
+
+ if (available > count)
+  available = count;
+
+ for (i = 0; i < available; i++, head++)
+ {
+  const uint32_t* const from =
+   &ring->entries[(head & (ring->capacity - 1)) * words];
+  uint32_t              j;
+
+  for (j = 0; j < words; j++)
+   to[j] = from[j];
+  to += words;
+ }
+
+ ring_publish(&ring->head, &ring->producer_waiting, head);
+ return available;
+}
+
+#endif /* _RING_H_ */
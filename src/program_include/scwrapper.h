@@ -87,6 +87,59 @@ alloc(int32_t length)
  return return_value;
 }
 
+/*! Wrapper for the system call that allocates an aligned memory block
+ *  @param length integer holding the number of bytes to allocate
+ *  @param alignment power of two the address of the block is a multiple of
+ */
+static inline void *
+alloc_aligned(int32_t length, uint32_t alignment)
+{
+ void * return_value;
+ __asm volatile("mov $1f, %%edx \n\t" 
+                "mov %%esp, %%ecx   \n\t" 
+                "sysenter         \n\t" 
+                 "1: \n\t" :
+                 "=a" (return_value) :
+                 "a" (SYSCALL_ALLOCATE_ALIGNED), "D" (length), "S" (alignment) :
+                 "cc", "%ecx", "%edx");
+ return return_value;
+}
+
+/*! Wrapper for the system call that allocates a zeroed memory block
+ *  @param length integer holding the number of bytes to allocate
+ */
+static inline void *
+alloc_zeroed(int32_t length)
+{
+ void * return_value;
+ __asm volatile("mov $1f, %%edx \n\t" 
+                "mov %%esp, %%ecx   \n\t" 
+                "sysenter         \n\t" 
+                 "1: \n\t" :
+                 "=a" (return_value) :
+                 "a" (SYSCALL_ALLOCATE_ZEROED), "D" (length) :
+                 "cc", "%ecx", "%edx", "memory");
+ return return_value;
+}
+
+/*! Wrapper for the system call that resizes a memory block.
+ *  @param address address to the memory block to resize.
+ *  @param length integer holding the new number of bytes in the block
+ */
+static inline void *
+resize(void * address, int32_t length)
+{
+ void * return_value;
+ __asm volatile("mov $1f, %%edx \n\t" 
+                "mov %%esp, %%ecx   \n\t" 
+                "sysenter         \n\t" 
+                 "1: \n\t" :
+                 "=a" (return_value) :
+                 "a" (SYSCALL_RESIZE), "D" (address), "S" (length) :
+                 "cc", "%ecx", "%edx", "memory");
+ return return_value;
+}
+
 /*! Wrapper for the system call that frees a memory block.
  *  @param address address to the memory block to free.
  */
@@ -104,17 +157,20 @@ free(void * address)
  return return_value;
 }
 
-/*! Wrapper for the system call that terminates threads and processes. */
+/*! Wrapper for the system call that terminates threads and processes.
+ * @param status exit status of the process if the thread is its last.
+ */
 static inline void
-terminate(void)
+terminate(const int32_t status)
 {
  __asm volatile("sysenter" :
                  :
-                 "a" (SYSCALL_TERMINATE) :
+                 "a" (SYSCALL_TERMINATE), "D" (status) :
                  "cc", "%ecx", "%edx");
 }
 
-/*! Wrapper for the system call that creates processes.
+/*! Wrapper for the system call that creates processes. Returns the id of
+ * the process or ERROR.
  * @param executable integer identifying the program which should be loaded 
  *  and run as a process.
  */
@@ -149,5 +205,317 @@ yield(void)
  return return_value;
 }
 
+/*! Wrapper for the system call that creates a copy of the calling process.
+ *  Returns 0 in the copy, the id of the copy in the caller or ERROR on
+ *  failure.
+ */
+static inline int32_t
+fork(void)
+{
+ int32_t return_value;
+ __asm volatile("mov $1f, %%edx \n\t" 
+                "mov %%esp, %%ecx   \n\t" 
+                "sysenter         \n\t" 
+                 "1: \n\t" :
+                 "=a" (return_value) :
+                 "a" (SYSCALL_FORK) :
+                 "cc", "%ecx", "%edx", "memory");
+ return return_value;
+}
+
+/*! Wrapper for the system call that carries out a batch of allocate and
+ *  free requests in one kernel entry.
+ *  @param requests array of requests. The result of each request is stored
+ *   in it.
+ *  @param count number of requests in the array.
+ */
+static inline int32_t
+memory_batch(struct memory_request* const requests, const uint32_t count)
+{
+ int32_t return_value;
+ __asm volatile("mov $1f, %%edx \n\t" 
+                "mov %%esp, %%ecx   \n\t" 
+                "sysenter         \n\t" 
+                 "1: \n\t" :
+                 "=a" (return_value) :
+                 "a" (SYSCALL_MEMORY_BATCH), "D" (requests), "S" (count) :
+                 "cc", "%ecx", "%edx", "memory");
+ return return_value;
+}
+
+/*! Wrapper for the system call that returns statistics on memory
+ *  allocation.
+ *  @param statistics structure the statistics are copied into.
+ */
+static inline int32_t
+memory_statistics(struct memory_statistics* const statistics)
+{
+ int32_t return_value;
+ __asm volatile("mov $1f, %%edx \n\t" 
+                "mov %%esp, %%ecx   \n\t" 
+                "sysenter         \n\t" 
+                 "1: \n\t" :
+                 "=a" (return_value) :
+                 "a" (SYSCALL_MEMORY_STATISTICS), "D" (statistics) :
+                 "cc", "%ecx", "%edx", "memory");
+ return return_value;
+}
+
+/*! Wrapper for the system call that sets the base priority of the calling
+ *  thread.
+ *  @param priority priority from 0, the highest, to PRIORITY_LEVELS - 1.
+ */
+static inline int32_t
+set_priority(const uint32_t priority)
+{
+ int32_t return_value;
+ __asm volatile("mov $1f, %%edx \n\t" 
+                "mov %%esp, %%ecx   \n\t" 
+                "sysenter         \n\t" 
+                 "1: \n\t" :
+                 "=a" (return_value) :
+                 "a" (SYSCALL_SET_PRIORITY), "D" (priority) :
+                 "cc", "%ecx", "%edx");
+ return return_value;
+}
+
+/*! Wrapper for the system call that creates a thread in the calling
+ *  process. The thread must call terminate rather than return. Returns the
+ *  id of the thread or an error code.
+ *  @param entry function the thread starts in.
+ *  @param stack_size number of bytes of stack, or 0 for the default.
+ */
+static inline int32_t
+create_thread(void (*entry)(void), const uint32_t stack_size)
+{
+ int32_t return_value;
+ __asm volatile("mov $1f, %%edx \n\t" 
+                "mov %%esp, %%ecx   \n\t" 
+                "sysenter         \n\t" 
+                 "1: \n\t" :
+                 "=a" (return_value) :
+                 "a" (SYSCALL_CREATE_THREAD), "D" (entry), "S" (stack_size) :
+                 "cc", "%ecx", "%edx");
+ return return_value;
+}
+
+/*! Wrapper for the system call that blocks the calling thread until
+ *  another thread calls wake on the same address. Returns at once with
+ *  ERROR_WOULD_BLOCK if the word at address does not hold expected.
+ *  @param address word to wait on.
+ *  @param expected value the word must hold for the thread to block.
+ */
+static inline int32_t
+wait(volatile uint32_t* const address, const uint32_t expected)
+{
+ int32_t return_value;
+ __asm volatile("mov $1f, %%edx \n\t" 
+                "mov %%esp, %%ecx   \n\t" 
+                "sysenter         \n\t" 
+                 "1: \n\t" :
+                 "=a" (return_value) :
+                 "a" (SYSCALL_WAIT), "D" (address), "S" (expected) :
+                 "cc", "%ecx", "%edx", "memory");
+ return return_value;
+}
+
+/*! Wrapper for the system call that wakes threads blocked in wait.
+ *  Returns the number of threads woken.
+ *  @param address word the threads wait on.
+ *  @param count largest number of threads to wake.
+ */
+static inline int32_t
+wake(volatile uint32_t* const address, const uint32_t count)
+{
+ int32_t return_value;
+ __asm volatile("mov $1f, %%edx \n\t" 
+                "mov %%esp, %%ecx   \n\t" 
+                "sysenter         \n\t" 
+                 "1: \n\t" :
+                 "=a" (return_value) :
+                 "a" (SYSCALL_WAKE), "D" (address), "S" (count) :
+                 "cc", "%ecx", "%edx", "memory");
+ return return_value;
+}
+/*! A message of the send, receive and reply system calls. */
+struct message
+{
+ uint32_t words[MESSAGE_WORDS]; /*!< The contents of the message. */
+};
+
+/*! Wrapper for the system call that returns the id of the calling
+ *  thread. */
+static inline int32_t
+thread_id(void)
+{
+ int32_t return_value;
+ __asm volatile("mov $1f, %%edx \n\t" 
+                "mov %%esp, %%ecx   \n\t" 
+                "sysenter         \n\t" 
+                 "1: \n\t" :
+                 "=a" (return_value) :
+                 "a" (SYSCALL_THREAD_ID) :
+                 "cc", "%ecx", "%edx");
+ return return_value;
+}
+
+/*! Wrapper for the system call that sends a message to a thread and waits
+ *  for the reply. Returns ALL_OK or ERROR.
+ *  @param thread id of the receiving thread.
+ *  @param message the message to send. It is replaced by the reply.
+ */
+static inline int32_t
+send(const uint32_t thread, struct message* const message)
+{
+ int32_t return_value;
+ __asm volatile("mov $1f, %%edx \n\t" 
+                "mov %%esp, %%ecx   \n\t" 
+                "sysenter         \n\t" 
+                 "1: \n\t" :
+                 "=a" (return_value),
+                 "+S" (message->words[0]), "+b" (message->words[1]) :
+                 "a" (SYSCALL_SEND), "D" (thread) :
+                 "cc", "%ecx", "%edx", "memory");
+ return return_value;
+}
+
+/*! Wrapper for the system call that waits for a message. Returns the id of
+ *  the sender.
+ *  @param message filled in with the message received.
+ */
+static inline int32_t
+receive(struct message* const message)
+{
+ int32_t return_value;
+ __asm volatile("mov $1f, %%edx \n\t" 
+                "mov %%esp, %%ecx   \n\t" 
+                "sysenter         \n\t" 
+                 "1: \n\t" :
+                 "=a" (return_value),
+                 "=S" (message->words[0]), "=b" (message->words[1]) :
+                 "a" (SYSCALL_RECEIVE), "D" (0) :
+                 "cc", "%ecx", "%edx", "memory");
+ return return_value;
+}
+
+/*! Wrapper for the system call that replies to a message and waits for
+ *  the next one. Returns the id of the sender of the next message, or
+ *  ERROR if thread does not wait for a reply.
+ *  @param thread id of the thread to reply to.
+ *  @param message the reply. It is replaced by the next message.
+ */
+static inline int32_t
+reply_and_receive(const uint32_t thread, struct message* const message)
+{
+ int32_t return_value;
+ __asm volatile("mov $1f, %%edx \n\t" 
+                "mov %%esp, %%ecx   \n\t" 
+                "sysenter         \n\t" 
+                 "1: \n\t" :
+                 "=a" (return_value),
+                 "+S" (message->words[0]), "+b" (message->words[1]) :
+                 "a" (SYSCALL_RECEIVE), "D" (thread) :
+                 "cc", "%ecx", "%edx", "memory");
+ return return_value;
+}
+
+/*! Wrapper for the system call that replies to a message. Returns ALL_OK,
+ *  or ERROR if thread does not wait for a reply.
+ *  @param thread id of the thread to reply to.
+ *  @param message the reply.
+ */
+static inline int32_t
+reply(const uint32_t thread, const struct message* const message)
+{
+ int32_t return_value;
+ __asm volatile("mov $1f, %%edx \n\t" 
+                "mov %%esp, %%ecx   \n\t" 
+                "sysenter         \n\t" 
+                 "1: \n\t" :
+                 "=a" (return_value) :
+                 "a" (SYSCALL_REPLY), "D" (thread),
+                 "S" (message->words[0]), "b" (message->words[1]) :
+                 "cc", "%ecx", "%edx");
+ return return_value;
+}
+
+/*! Wrapper for the system call that maps memory into the calling process
+ *  and another process, at the same address in both. Returns the address
+ *  or ERROR.
+ *  @param thread id of a thread of the other process.
+ *  @param size number of bytes to share.
+ */
+static inline void*
+share_memory(const uint32_t thread, const uint32_t size)
+{
+ void* return_value;
+ __asm volatile("mov $1f, %%edx \n\t" 
+                "mov %%esp, %%ecx   \n\t" 
+                "sysenter         \n\t" 
+                 "1: \n\t" :
+                 "=a" (return_value) :
+                 "a" (SYSCALL_SHARE_MEMORY), "D" (thread), "S" (size) :
+                 "cc", "%ecx", "%edx");
+ return return_value;
+}
+
+/*! Wrapper for the system call that waits for a child process to
+ *  terminate. Returns the id of the child, or ERROR if there is no such
+ *  child.
+ *  @param child id of the child, or 0 for any child.
+ *  @param status filled in with the exit status of the child. May be 0.
+ */
+static inline int32_t
+wait_child(const uint32_t child, int32_t* const status)
+{
+ int32_t return_value;
+ int32_t exit_status;
+ __asm volatile("mov $1f, %%edx \n\t" 
+                "mov %%esp, %%ecx   \n\t" 
+                "sysenter         \n\t" 
+                 "1: \n\t" :
+                 "=a" (return_value), "=S" (exit_status) :
+                 "a" (SYSCALL_WAIT_CHILD), "D" (child) :
+                 "cc", "%ecx", "%edx");
+ if ((0 != status) && (ERROR != return_value))
+  *status = exit_status;
+ return return_value;
+}
+
+/*! Wrapper for the system call that sets up the rings through which the
+ *  process queues operations for the kernel. Returns the rings, or ERROR.
+ *  @param entries number of submission entries.
+ */
+static inline struct async_rings*
+async_setup(const uint32_t entries)
+{
+ struct async_rings* return_value;
+ __asm volatile("mov $1f, %%edx \n\t" 
+                "mov %%esp, %%ecx   \n\t" 
+                "sysenter         \n\t" 
+                 "1: \n\t" :
+                 "=a" (return_value) :
+                 "a" (SYSCALL_ASYNC_SETUP), "D" (entries) :
+                 "cc", "%ecx", "%edx", "memory");
+ return return_value;
+}
+
+/*! Wrapper for the system call that carries out the operations queued in
+ *  the submission ring. Returns the number of operations taken from the
+ *  ring, or ERROR.
+ */
+static inline int32_t
+async_enter(void)
+{
+ int32_t return_value;
+ __asm volatile("mov $1f, %%edx \n\t" 
+                "mov %%esp, %%ecx   \n\t" 
+                "sysenter         \n\t" 
+                 "1: \n\t" :
+                 "=a" (return_value) :
+                 "a" (SYSCALL_ASYNC_ENTER) :
+                 "cc", "%ecx", "%edx", "memory");
+ return return_value;
+}
 
 #endif /* _SCWRAPPER_H_ */
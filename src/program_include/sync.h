@@ -0,0 +1,134 @@
+/* Copyright (c) 1997-2016, FenixOS Developers
+   All Rights Reserved.
+
+   This file is subject to the terms and conditions defined in
+   file 'LICENSE', which is part of this source code package.
+ */
+
+/*! \file sync.h
+ *  This file contains mutexes and condition variables for the threads of a
+ *  user program. They are built on the wait and wake system calls. Taking a
+ *  free mutex and releasing a mutex nobody waits for are done with a single
+ *  locked instruction and do not enter the kernel. A thread that has to
+ *  wait sleeps in the kernel rather than spinning.
+ */
+
+#ifndef _SYNC_H_
+#define _SYNC_H_
+
+#include <scwrapper.h>
+#include <instruction_wrappers.h>
+
+/*! The mutex is free. */
+#define MUTEX_FREE          (0)
+
+/*! The mutex is taken and no thread waits for it. */
+#define MUTEX_TAKEN         (1)
+
+/*! The mutex is taken and threads may wait for it. */
+#define MUTEX_CONTENDED     (2)
+
+/*! Defines a mutex. */
+struct mutex
+{
+ volatile uint32_t state; /*!< MUTEX_FREE, MUTEX_TAKEN or
+                               MUTEX_CONTENDED. */
+};
+
+/*! Defines a condition variable. */
+struct condition
+{
+ volatile uint32_t sequence; /*!< Counts signals. Waiters sleep on it
+                                  changing. */
+};
+
+/*! Sets up a mutex as free.
+ *  @param mutex the mutex.
+ */
+static inline void
+mutex_init(struct mutex* const mutex)
+{
+ mutex->state = MUTEX_FREE;
+}
+
+/*! Takes a mutex, sleeping until it is free.
+ *  @param mutex the mutex.
+ */
+static inline void
+mutex_lock(struct mutex* const mutex)
+{
+ uint32_t state = lock_cmpxchg(&mutex->state, MUTEX_FREE, MUTEX_TAKEN);
+
+ if (MUTEX_FREE == state)
+  return;
+
+ /* Mark the mutex as contended before sleeping, so the thread releasing
+    it knows to wake a waiter. The mutex stays marked after it is taken
+    here, as other threads may still wait. */
+ if (MUTEX_CONTENDED != state)
+  state = lock_xchg(&mutex->state, MUTEX_CONTENDED);
+
+ while (MUTEX_FREE != state)
+ {
+  wait(&mutex->state, MUTEX_CONTENDED);
+  state = lock_xchg(&mutex->state, MUTEX_CONTENDED);
+ }
+}
+
+/*! Releases a mutex taken by the calling thread and wakes a thread waiting
+ *  for it, if any.
+ *  @param mutex the mutex.
+ */
+static inline void
+mutex_unlock(struct mutex* const mutex)
+{
+ if (MUTEX_TAKEN != lock_xchg(&mutex->state, MUTEX_FREE))
+  wake(&mutex->state, 1);
+}
+
+/*! Sets up a condition variable.
+ *  @param condition the condition variable.
+ */
+static inline void
+condition_init(struct condition* const condition)
+{
+ condition->sequence = 0;
+}
+
+/*! Releases a mutex, sleeps until the condition variable is signalled and
+ *  takes the mutex again. The caller must hold the mutex, and must check
+ *  the condition it waits for again as the thread may wake early.
+ *  @param condition the condition variable.
+ *  @param mutex the mutex protecting the condition.
+ */
+static inline void
+condition_wait(struct condition* const condition, struct mutex* const mutex)
+{
+ const uint32_t sequence = condition->sequence;
+
+ mutex_unlock(mutex);
+ wait(&condition->sequence, sequence);
+ mutex_lock(mutex);
+}
+
+/*! Wakes one thread waiting on a condition variable.
+ *  @param condition the condition variable.
+ */
+static inline void
+condition_signal(struct condition* const condition)
+{
+ lock_xadd(&condition->sequence, 1);
+ wake(&condition->sequence, 1);
+}
+
+/*! Wakes all threads waiting on a condition variable.
+ *  @param condition the condition variable.
+ */
+static inline void
+condition_broadcast(struct condition* const condition)
+{
+ lock_xadd(&condition->sequence, 1);
+ wake(&condition->sequence, UINT32_MAX);
+}
+
+#endif /* _SYNC_H_ */
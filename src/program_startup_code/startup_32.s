@@ -13,6 +13,10 @@ _start:
  # Setup stack pointer
  mov $stack, %esp
 
+ # Leave the stack aligned to 16 bytes at the call, as code using SSE
+ # expects
+ sub $8, %esp
+
  # main expects two arguments: argc and argv
  push $argv
  push 1
@@ -21,7 +25,9 @@ _start:
  call main
 
  # When main returns, perform the terminate system call
- # so the kernel can clean up
+ # so the kernel can clean up. The value main returned is
+ # the exit status.
+ mov %eax, %edi
  mov $6, %eax
  sysenter
  # NOTE: we never return!
@@ -36,6 +42,6 @@ argv:
  .int  0
 
 .section .bss
-.align 4
+.align 16
 .skip 8 * 1024
 stack: